@@ -0,0 +1,85 @@
+/*
+ * pval_perfbuf.c: BPF program exporting pval records into a BPF perf
+ * event array from the pval_record tracepoint.
+ *
+ * Load it and attach it to tracepoint/pval/pval_record with libbpf,
+ * and consume struct pval_bpf_record from the pval_pb map with
+ * perf_buffer__new(). Build with -DSNAPLEN=N (up to PVAL_PKT_LEN) to
+ * change the number of packet bytes in each record.
+ *
+ * It uses only BPF_MAP_TYPE_PERF_EVENT_ARRAY, bpf_perf_event_output()
+ * and bpf_probe_read() on a tracepoint of a module, so that it works
+ * on kernels the module is built for (4.18 and later).
+ */
+
+#include <linux/bpf.h>
+
+#include <pval.h>
+
+#define SEC(name) __attribute__((section(name), used))
+#define __uint(name, val) int (*name)[val]
+
+#ifndef SNAPLEN
+#define SNAPLEN	64	/* max bytes of pkt in each record */
+#endif
+
+#ifndef MAX_CPUS
+#define MAX_CPUS	128
+#endif
+
+static int (*bpf_perf_event_output)(void *ctx, void *map, __u64 flags,
+				    void *data, __u64 size) =
+	(void *) BPF_FUNC_perf_event_output;
+static int (*bpf_probe_read)(void *dst, __u32 size, const void *src) =
+	(void *) BPF_FUNC_probe_read;
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERF_EVENT_ARRAY);
+	__uint(key_size, sizeof(int));
+	__uint(value_size, sizeof(int));
+	__uint(max_entries, MAX_CPUS);
+} pval_pb SEC(".maps");
+
+/* entry of the pval_record tracepoint (kmod/pval_trace.h), see
+ * /sys/kernel/debug/tracing/events/pval/pval_record/format
+ */
+struct pval_record_args {
+	__u64	common;		/* struct trace_entry */
+	__u32	data_loc_name;
+	__u8	cpu;
+	__u8	dir;
+	__u32	pktlen;
+	__u32	caplen;
+	__u64	tstamp;
+	struct pval_meta meta;
+	__u32	data_loc_pkt;	/* offset | len << 16 of pkt */
+};
+
+SEC("tracepoint/pval/pval_record")
+int pval_perfbuf(struct pval_record_args *ctx)
+{
+	char buf[sizeof(struct pval_bpf_record) + SNAPLEN];
+	struct pval_bpf_record *rec = (struct pval_bpf_record *)buf;
+	__u32 caplen = ctx->caplen;
+	__u32 off = ctx->data_loc_pkt & 0xffff;
+
+	if (caplen > SNAPLEN)
+		caplen = SNAPLEN;
+
+	__builtin_memset(buf, 0, sizeof(buf));
+	rec->tstamp = ctx->tstamp;
+	rec->pktlen = ctx->pktlen;
+	rec->caplen = caplen;
+	rec->cpu = ctx->cpu;
+	rec->dir = ctx->dir;
+	bpf_probe_read(&rec->meta, sizeof(rec->meta), &ctx->meta);
+	if (caplen > 0)
+		bpf_probe_read(rec->pkt, caplen, (void *)ctx + off);
+
+	/* dropped when the consumer is behind */
+	bpf_perf_event_output(ctx, &pval_pb, BPF_F_CURRENT_CPU,
+			      buf, sizeof(buf));
+	return 0;
+}
+
+char _license[] SEC("license") = "GPL";
@@ -6,6 +6,7 @@
 
 #ifndef __KERNEL__
 #include <asm/types.h>
+#include <linux/ioctl.h>
 #endif
 
 /* Pval IP Option */
@@ -15,11 +16,63 @@
 struct ipopt_pval {
 	__u8 	type;
 	__u8	length;
-	__u8	reserved;
+	__u8	ver;	/* version (bit 4-7) and flags (bit 0-3) */
 	__u8	cpu;
 	__u64	seq;
 } __attribute__ ((__packed__));
 
+#define IPOPT_PVAL_VER(ver)	((ver) >> 4)
+#define IPOPT_PVAL_MKVER(v)	((v) << 4)
+
+#define IPOPT_PVAL_V0		0	/* cpu and seq */
+#define IPOPT_PVAL_V1		1	/* cpu, seq and sender's tstamp */
+
+#define IPOPT_PVAL_F_FLOWSEQ	0x01	/* seq is per flow */
+
+/* Pval IP Option version 1. length is 16 for 32bit tstamp (lower 32
+ * bits of nsec) and 20 for 64bit tstamp (nsec). tstamp is
+ * CLOCK_REALTIME of the sender at xmit.
+ */
+struct ipopt_pval_v1 {
+	struct ipopt_pval	pval;
+	union {
+		__u32	ts32;
+		__u64	ts64;
+	} __attribute__ ((__packed__)) ts;
+} __attribute__ ((__packed__));
+
+#define IPOPT_PVAL_LEN_V0	sizeof(struct ipopt_pval)
+#define IPOPT_PVAL_LEN_TS32	(sizeof(struct ipopt_pval) + 4)
+#define IPOPT_PVAL_LEN_TS64	(sizeof(struct ipopt_pval) + 8)
+
+/* Carriers of Pval IP Option. The option is carried in the IPv4
+ * header, in an Ethernet trailer, or after the UDP header of packets
+ * to a UDP port, in the same format.
+ */
+enum {
+	PVAL_CARRIER_IPOPT,	/* IPv4 header option (default) */
+	PVAL_CARRIER_TRAILER,	/* Ethernet trailer after the payload */
+	PVAL_CARRIER_UDP,	/* shim after the UDP header */
+	__PVAL_CARRIER_MAX
+};
+#define PVAL_CARRIER_MAX	(__PVAL_CARRIER_MAX - 1)
+
+/* Pval Ethernet trailer. It follows the option at the end of the
+ * frame. Frames shorter than 60 bytes are zero-padded before the
+ * option, so that NICs do not pad after the trailer.
+ */
+struct pval_trailer {
+	__u8	length;		/* length of the preceding option */
+	__u8	reserved[3];
+	__u32	magic;		/* PVAL_TRAILER_MAGIC in network order */
+} __attribute__ ((__packed__));
+
+#define PVAL_TRAILER_MAGIC	0x5076616c	/* "Pval" */
+
+#define PVAL_UDP_PORT_DEFAULT	20566		/* "PV" */
+
+#define PVAL_MAX_LINKS		4	/* lower links in IFLA_PVAL_LINKS */
+
 
 
 /* Netlink parameters */
@@ -32,6 +85,31 @@ enum {
 	IFLA_PVAL_TXCOPY,	/* ON/OFF: Copy TXed pkts to user */
 	IFLA_PVAL_RXCOPY,	/* ON/OFF: Copy RXed pkts to user */
 	IFLA_PVAL_TXBUSYDROP,	/* ON/OFF: Drop TXed pkts when tstamp busy */
+	IFLA_PVAL_WAKEUP,	/* u32: num of pkts to wake up blocked readers */
+	IFLA_PVAL_BUSYPOLL,	/* u32: usecs readers spin before sleeping */
+	IFLA_PVAL_LAYOUT,	/* u8: PVAL_LAYOUT_*, ring layout */
+	IFLA_PVAL_GRO,		/* u8: PVAL_GRO_*, how to record GRO/GSO pkts */
+	IFLA_PVAL_TSSRC,	/* u8: PVAL_TSSRC_*, timestamp source */
+	IFLA_PVAL_CLKCORR,	/* u32: msecs between clock records, 0 is off */
+	IFLA_PVAL_FLOWSEQ,	/* ON/OFF: seq of Pval IP Option per flow */
+	IFLA_PVAL_IPOPTTS,	/* u8: 0, 32 or 64, bits of tstamp in option */
+	IFLA_PVAL_CARRIER,	/* u8: PVAL_CARRIER_* */
+	IFLA_PVAL_UDPPORT,	/* u16: UDP port of PVAL_CARRIER_UDP */
+	IFLA_PVAL_HUGEPAGE,	/* ON/OFF: rings on huge pages, mmap()able */
+	IFLA_PVAL_XDPFD,	/* s32: XDP prog fd for lower link, -1 detaches */
+	IFLA_PVAL_XDP,		/* ON/OFF: XDP prog attached (dump only) */
+	IFLA_PVAL_PACEGAP,	/* u32: nsecs between TXed pkts, 0 is off */
+	IFLA_PVAL_PACERATE,	/* u64: bits per sec of TXed pkts, 0 is off */
+	IFLA_PVAL_PACEMARK,	/* u32: pace only pkts of this mark, 0 is all */
+	IFLA_PVAL_PAD,
+	IFLA_PVAL_PROMISC,	/* ON/OFF: lower link in promiscuous mode */
+	IFLA_PVAL_PASSIVE,	/* ON/OFF: tap lower link without enslaving it */
+	IFLA_PVAL_LINKS,	/* u32 array: ifindexes of all lower links */
+	IFLA_PVAL_TXQSTATE,	/* ON/OFF: record TX queue state at xmit */
+	IFLA_PVAL_BURSTWIN,	/* u32: nsecs of microburst window, 0 is off */
+	IFLA_PVAL_BURSTBYTES,	/* u32: bytes in a window to be a burst */
+	IFLA_PVAL_RINGSIZE,	/* u32: num of slots of a ring, power of 2 */
+	IFLA_PVAL_SNAPLEN,	/* u16: bytes of a packet copied to a record */
 	__IFLA_PVAL_MAX
 };
 #define IFLA_PVAL_MAX	(__IFLA_PVAL_MAX - 1)
@@ -50,15 +128,250 @@ enum {
 
 #define PVAL_PKT_LEN	256
 
+/* pval_meta is packet metadata parsed by the kernel. Offsets are
+ * from the head of pval_slot->pkt (ethernet header).
+ */
+struct pval_meta {
+	__u16	l3off;		/* offset of network header */
+	__u16	l4off;		/* offset of transport header */
+	__u16	proto;		/* ethertype (network byte order) */
+	__u8	ipproto;	/* IP protocol or IPv6 next header */
+	__u8	dir;		/* PVAL_DIR_* */
+	__u32	hash;		/* flow hash */
+	__u32	ifindex;	/* lower link */
+	__u16	queue;		/* queue id */
+	__u16	vlan_tci;	/* VLAN tag */
+	__u8	flags;		/* PVAL_META_F_* */
+	__u8	cpu;		/* cpu of Pval IP Option */
+	__u16	segs;		/* num of wire packets of GRO/GSO pkt */
+	__u64	seq;		/* seq of Pval IP Option */
+	__u16	seg;		/* segment index (PVAL_META_F_SEG) */
+	__u8	tssrc;		/* PVAL_TSSRC_* of pval_slot->tstamp */
+	__u8	type;		/* PVAL_REC_* */
+	__u8	carrier;	/* PVAL_CARRIER_* of the option */
+	__u8	xflags;		/* PVAL_META_X_* */
+	__u8	reserved[2];
+	__u64	txts;		/* sender's tstamp in Pval IP Option */
+	__u64	sched;		/* scheduled departure, CLOCK_REALTIME nsec */
+	__u32	inflight;	/* BQL bytes in flight on the TX queue */
+	__u32	backlog;	/* qdisc backlog bytes of the TX queue */
+} __attribute__((__packed__));
+
+#define PVAL_DIR_TX	0
+#define PVAL_DIR_RX	1
+
+#define PVAL_META_F_L3		0x01	/* l3off is valid */
+#define PVAL_META_F_L4		0x02	/* l4off and ipproto are valid */
+#define PVAL_META_F_VLAN	0x04	/* vlan_tci is valid */
+#define PVAL_META_F_IPOPT	0x08	/* cpu and seq are valid */
+#define PVAL_META_F_GSO		0x10	/* aggregation of segs packets */
+#define PVAL_META_F_SEG		0x20	/* seg-th segment of segs packets */
+#define PVAL_META_F_TXTS	0x40	/* txts is valid */
+#define PVAL_META_F_SCHED	0x80	/* sched is valid (paced TX) */
+
+#define PVAL_META_X_TXQ		0x01	/* queue, inflight, backlog at xmit */
+
+/* Record types. A PVAL_REC_GAP record is put before the first record
+ * written after the ring was full or frozen, and its tstamp is when the
+ * first record was dropped. pkt also has the num of them as __le64.
+ */
+#define PVAL_REC_PKT	0	/* captured packet */
+#define PVAL_REC_CLOCK	1	/* struct pval_clock in pkt */
+#define PVAL_REC_OVERRUN 2	/* meta.seq (desc.seq) records overwritten */
+#define PVAL_REC_BURST	3	/* struct pval_burst in pkt */
+#define PVAL_REC_GAP	4	/* meta.seq (desc.seq) records dropped before */
+
+/* Clock correlation record. tstamp of the record is phc. */
+struct pval_clock {
+	__u64	phc;		/* PHC of the lower link (nsec) */
+	__u64	realtime;	/* CLOCK_REALTIME (nsec) */
+	__u64	monoraw;	/* CLOCK_MONOTONIC_RAW (nsec) */
+	__s32	phc_index;	/* /dev/ptpN */
+	__u32	error;		/* uncertainty of the triple (nsec) */
+} __attribute__((__packed__));
+
+/* Microburst record. Consecutive windows of burstwin nsec with
+ * burstbytes or more make a burst. tstamp of the record is start, and
+ * start and end are packet timestamps of meta.tssrc.
+ */
+struct pval_burst {
+	__u64	start;		/* first window */
+	__u64	end;		/* last packet */
+	__u64	bytes;
+	__u32	pkts;
+	__u32	hash;		/* flow hash of the top talker */
+	__u32	window;		/* burstwin in nsec */
+	__u32	windows;	/* num of windows over burstbytes */
+} __attribute__((__packed__));
+
 /* pval_slot is stored in each iovec by readv() syscall */
 struct pval_slot {
 	__u32	len;
 	__u32	pktlen;
 	__u64	tstamp;
+	struct pval_meta meta;
 	char	pkt[PVAL_PKT_LEN];
 } __attribute__((__packed__));
 
 
+/* Ring layouts */
+enum {
+	PVAL_LAYOUT_SLOT,	/* array of pval_slot (default) */
+	PVAL_LAYOUT_SPLIT,	/* array of pval_desc + payload area */
+	__PVAL_LAYOUT_MAX
+};
+#define PVAL_LAYOUT_MAX	(__PVAL_LAYOUT_MAX - 1)
+
+/* pval_desc is a fixed-size descriptor of the split layout. readv()
+ * stores descriptors densely into the first iovec, and payloads into
+ * the second iovec (if given) at pval_desc->off.
+ */
+struct pval_desc {
+	__u64	tstamp;
+	__u32	pktlen;
+	__u16	caplen;
+	__u8	cpu;	/* cpu of Pval IP Option */
+	__u8	flags;	/* PVAL_DESC_F_* */
+	__u32	hash;	/* flow hash */
+	__u32	off;	/* offset of payload in the second iovec */
+	__u64	seq;	/* seq of Pval IP Option */
+} __attribute__((__packed__));
+
+#define PVAL_DESC_F_IPOPT	0x01	/* cpu and seq are valid */
+#define PVAL_DESC_F_PAYLOAD	0x02	/* payload is stored at off */
+#define PVAL_DESC_F_GSO		0x04	/* aggregation of GRO/GSO pkts */
+#define PVAL_DESC_F_TYPE_HI	0x08	/* bit 2 of PVAL_REC_* */
+#define PVAL_DESC_F_TSSRC_SHIFT	4	/* bit 4-5: PVAL_TSSRC_* of tstamp */
+#define PVAL_DESC_F_TSSRC_MASK	(0x3 << PVAL_DESC_F_TSSRC_SHIFT)
+#define PVAL_DESC_TSSRC(flags)	\
+	(((flags) & PVAL_DESC_F_TSSRC_MASK) >> PVAL_DESC_F_TSSRC_SHIFT)
+#define PVAL_DESC_F_TYPE_SHIFT	6	/* bit 6-7: PVAL_REC_* */
+#define PVAL_DESC_F_TYPE_MASK	(0x3 << PVAL_DESC_F_TYPE_SHIFT)
+#define PVAL_DESC_TYPE(flags)						\
+	((((flags) & PVAL_DESC_F_TYPE_MASK) >> PVAL_DESC_F_TYPE_SHIFT) |	\
+	 (((flags) & PVAL_DESC_F_TYPE_HI) >> 1))
+
+#define PVAL_DESC_PAYLOAD_ALIGN	8
+
+
+/* Hugepage-backed rings (hugepage on) can be mmap()ed with MAP_SHARED.
+ * The mapping starts with pval_mmap_hdr, and records are at slots_off
+ * (PVAL_LAYOUT_SLOT), or at descs_off and payload_off + index *
+ * PVAL_PKT_LEN (PVAL_LAYOUT_SPLIT). Records from tail to head - 1 are
+ * valid, and the reader advances tail after consuming them.
+ */
+struct pval_mmap_hdr {
+	__u32	head;		/* written by the kernel */
+	__u32	tail;		/* written by the reader */
+	__u32	mask;		/* number of slots - 1 */
+	__u8	layout;		/* PVAL_LAYOUT_* */
+	__u8	reserved[3];
+	__u64	size;		/* length of the mapping */
+	__u64	slots_off;
+	__u64	descs_off;
+	__u64	payload_off;
+};
+
+
+/* ioctl on Pval character devices. arg is the value, not a pointer.
+ *
+ * PVAL_IOC_OVERWRITE 1 makes the ring keep the newest records: when the
+ * ring is full, the oldest record is dropped, and the next read()
+ * returns a PVAL_REC_OVERRUN record first with the number of them.
+ * PVAL_IOC_FREEZE 1 stops recording so that the contents can be read
+ * as a snapshot, and 0 resumes it. Both are reset on open().
+ */
+#define PVAL_IOC_MAGIC		0xBA
+#define PVAL_IOC_OVERWRITE	_IO(PVAL_IOC_MAGIC, 1)
+#define PVAL_IOC_FREEZE		_IO(PVAL_IOC_MAGIC, 2)
+#define PVAL_IOC_DELTA		_IO(PVAL_IOC_MAGIC, 3)
+
+
+/* Delta stream. After PVAL_IOC_DELTA 1, read() returns a byte stream
+ * of variable-length records instead of pval_slot or pval_desc, in
+ * either layout. Each record starts with a varint (LEB128) tag whose
+ * bits 0-1 are PVAL_DELTA_T_*:
+ *
+ * T_PKT:  tag >> 2 is the zigzag-encoded delta of tstamp from the
+ *         previous packet record or sync point, followed by varint
+ *         pktlen and __u8 flow id (< PVAL_DELTA_FLOWS).
+ * T_FLOW: T_PKT followed by __le32 flow hash, which the flow id
+ *         stands for from now on.
+ * T_SYNC: followed by __le64 tstamp. It resets the base of deltas
+ *         and the flow table (all hashes 0).
+ * T_REC:  tag >> 2 is PVAL_REC_* other than PVAL_REC_PKT, followed by
+ *         __le64 tstamp, __u8 length and that many bytes of the
+ *         record (pval_clock, pval_burst, or __le64 num of
+ *         overwritten or dropped records).
+ *
+ * The first packet record of each read() follows a sync point, and
+ * another one is put every PVAL_DELTA_SYNC packet records, so that a
+ * decoder can start at any read().
+ * read() returns the number of bytes.
+ */
+#define PVAL_DELTA_T_PKT	0
+#define PVAL_DELTA_T_FLOW	1
+#define PVAL_DELTA_T_SYNC	2
+#define PVAL_DELTA_T_REC	3
+#define PVAL_DELTA_T_MASK	0x3
+#define PVAL_DELTA_T_SHIFT	2
+
+#define PVAL_DELTA_FLOWS	64
+#define PVAL_DELTA_SYNC		1024
+#define PVAL_DELTA_REC_MAX	64	/* longest record and sync point */
+
+
+/* Recording GRO/GSO packets */
+enum {
+	PVAL_GRO_AGGR,	/* one record with num of segments (default) */
+	PVAL_GRO_SEGS,	/* one record per segment */
+	__PVAL_GRO_MAX
+};
+#define PVAL_GRO_MAX	(__PVAL_GRO_MAX - 1)
+
+
+/* Timestamp sources */
+enum {
+	PVAL_TSSRC_HW,	/* NIC hardware clock (default), falls back to SW */
+	PVAL_TSSRC_SW,	/* CLOCK_REALTIME nsec at RX handler or xmit */
+	PVAL_TSSRC_TSC,	/* CPU cycle counter at RX handler or xmit */
+	PVAL_TSSRC_XDP,	/* CLOCK_REALTIME nsec at XDP on RX, SW on TX */
+	__PVAL_TSSRC_MAX
+};
+#define PVAL_TSSRC_MAX	(__PVAL_TSSRC_MAX - 1)
+
+
+/* XDP metadata put in front of RXed frames by the XDP program attached
+ * to the lower link (xdp/pval_xdp.c). tstamp is bpf_ktime_get_ns()
+ * (CLOCK_MONOTONIC) at the XDP hook, before the skb is allocated, and
+ * is used as the RX timestamp with tssrc xdp.
+ */
+struct pval_xdp_meta {
+	__u64	tstamp;
+	__u32	reserved;
+	__u32	magic;		/* PVAL_XDP_MAGIC */
+};
+
+#define PVAL_XDP_MAGIC		0x50786470	/* "Pxdp" */
+
+
+/* Record sent to a BPF perf event array (BPF_MAP_TYPE_PERF_EVENT_ARRAY)
+ * by bpf/pval_perfbuf.c from the pval_record tracepoint. The snap
+ * length of the program follows in pkt, and its first caplen bytes
+ * are valid.
+ */
+struct pval_bpf_record {
+	__u64	tstamp;
+	__u32	pktlen;
+	__u32	caplen;
+	__u8	cpu;		/* ring of the record */
+	__u8	dir;		/* PVAL_DIR_* */
+	__u8	reserved[6];
+	struct pval_meta meta;
+	char	pkt[];
+} __attribute__((__packed__));
+
+
 
 
 #endif /* _PVAL_H_ */
@@ -7,9 +7,12 @@
 #include <string.h>
 #include <net/if.h>
 
+#include <linux/bpf.h>
+
 #include "rt_names.h"
 #include "utils.h"
 #include "ip_common.h"
+#include "bpf_util.h"
 
 #include "../../include/pval.h"
 
@@ -30,13 +33,36 @@ static void check_duparg(__u64 *attrs, int type, const char *key,
 static void print_explain(FILE *f)
 {
 	fprintf(f,
-		"Usage: ... pval link PHYS_DEV\n"
+		"Usage: ... pval link PHYS_DEV [ link PHYS_DEV ... ]\n"
 		"                 [ ipopt { on | off } ]\n"
 		"                 [ txtstamp { on | off } ]\n"
 		"                 [ rxtstamp { on | off } ]\n"
 		"                 [ txcopy { on | off } ]\n"
 		"                 [ rxcopy { on | off } ]\n"
 		"                 [ txbusydrop { on | off } ]\n"
+		"                 [ flowseq { on | off } ]\n"
+		"                 [ ipoptts { 0 | 32 | 64 } ]\n"
+		"                 [ carrier { ipopt | trailer | udp } ]\n"
+		"                 [ udpport PORT ]\n"
+		"                 [ hugepage { on | off } ]\n"
+		"                 [ promisc { on | off } ]\n"
+		"                 [ passive { on | off } ]\n"
+		"                 [ txqstate { on | off } ]\n"
+		"                 [ wakeup NUM ]\n"
+		"                 [ busypoll USEC ]\n"
+		"                 [ layout { slot | split } ]\n"
+		"                 [ ringsize SLOTS ]\n"
+		"                 [ snaplen BYTES ]\n"
+		"                 [ gro { aggr | segs } ]\n"
+		"                 [ tssrc { hw | sw | tsc | xdp } ]\n"
+		"                 [ clkcorr MSEC ]\n"
+		"                 [ xdp { object FILE [ section NAME ] |\n"
+		"                         pinned FILE | off } ]\n"
+		"                 [ pacegap NSEC ]\n"
+		"                 [ pacerate BPS ]\n"
+		"                 [ pacemark MARK ]\n"
+		"                 [ burstwin NSEC ]\n"
+		"                 [ burstbytes BYTES ]\n"
 		);
 }
 
@@ -45,21 +71,55 @@ static void explain(void)
 	print_explain(stderr);
 }
 
+static void pval_xdp_cb(void *nl, int fd, const char *annotation)
+{
+	addattr32(nl, 1024, IFLA_PVAL_XDPFD, fd);
+}
+
+static const struct bpf_cfg_ops pval_xdp_ops = {
+	.ebpf_cb = pval_xdp_cb,
+};
+
+static int pval_xdp_parse(int *argc, char ***argv, struct nlmsghdr *n)
+{
+	struct bpf_cfg_in cfg = {
+		.type = BPF_PROG_TYPE_XDP,
+		.argc = *argc,
+		.argv = *argv,
+	};
+
+	if (!matches(**argv, "off")) {
+		pval_xdp_cb(n, -1, NULL);
+		return 0;
+	}
+
+	if (bpf_parse_and_load_common(&cfg, &pval_xdp_ops, n))
+		return -1;
+
+	*argc = cfg.argc;
+	*argv = cfg.argv;
+	return 0;
+}
+
 static int pval_parse_opt(struct link_util *lu, int argc, char **argv,
 			  struct nlmsghdr *n)
 {
 	__u64 attrs = 0;
-	__u32 link = 0;
+	__u32 links[PVAL_MAX_LINKS];
+	int nlinks = 0;
+	__u32 val;
+	__u64 val64;
 
 	while (argc > 0) {
 		if (!matches(*argv, "link")) {
 			NEXT_ARG();
-			check_duparg(&attrs, IFLA_PVAL_LINK, "link", *argv);
-			link = if_nametoindex(*argv);
-			if (!link) {
+			if (nlinks == PVAL_MAX_LINKS)
+				invarg("too many links", *argv);
+			links[nlinks] = if_nametoindex(*argv);
+			if (!links[nlinks]) {
 				invarg("invalid device", *argv);
 			}
-			addattr32(n, 1024, IFLA_PVAL_LINK, link);
+			nlinks++;
 		} else if (!matches(*argv, "ipopt")) {
 			NEXT_ARG();
 			check_duparg(&attrs, IFLA_PVAL_IPOPT, "ipopt", *argv);
@@ -119,6 +179,196 @@ static int pval_parse_opt(struct link_util *lu, int argc, char **argv,
 				addattr8(n, 1024, IFLA_PVAL_TXBUSYDROP, 0);
 			else
 				invarg("invalid parameter", *argv);
+		} else if (!matches(*argv, "flowseq")) {
+			NEXT_ARG();
+			check_duparg(&attrs, IFLA_PVAL_FLOWSEQ,
+				     "flowseq", *argv);
+			if (!matches(*argv, "on"))
+				addattr8(n, 1024, IFLA_PVAL_FLOWSEQ, 1);
+			else if (!matches(*argv, "off"))
+				addattr8(n, 1024, IFLA_PVAL_FLOWSEQ, 0);
+			else
+				invarg("invalid parameter", *argv);
+		} else if (!matches(*argv, "ipoptts")) {
+			NEXT_ARG();
+			check_duparg(&attrs, IFLA_PVAL_IPOPTTS, "ipoptts",
+				     *argv);
+			if (get_u32(&val, *argv, 0) ||
+			    (val != 0 && val != 32 && val != 64))
+				invarg("invalid ipoptts", *argv);
+			addattr8(n, 1024, IFLA_PVAL_IPOPTTS, val);
+		} else if (!matches(*argv, "carrier")) {
+			NEXT_ARG();
+			check_duparg(&attrs, IFLA_PVAL_CARRIER, "carrier",
+				     *argv);
+			if (!matches(*argv, "ipopt"))
+				addattr8(n, 1024, IFLA_PVAL_CARRIER,
+					 PVAL_CARRIER_IPOPT);
+			else if (!matches(*argv, "trailer"))
+				addattr8(n, 1024, IFLA_PVAL_CARRIER,
+					 PVAL_CARRIER_TRAILER);
+			else if (!matches(*argv, "udp"))
+				addattr8(n, 1024, IFLA_PVAL_CARRIER,
+					 PVAL_CARRIER_UDP);
+			else
+				invarg("invalid carrier", *argv);
+		} else if (!matches(*argv, "udpport")) {
+			NEXT_ARG();
+			check_duparg(&attrs, IFLA_PVAL_UDPPORT, "udpport",
+				     *argv);
+			if (get_u32(&val, *argv, 0) || val == 0 || val > 65535)
+				invarg("invalid udpport", *argv);
+			addattr16(n, 1024, IFLA_PVAL_UDPPORT, val);
+		} else if (!matches(*argv, "hugepage")) {
+			NEXT_ARG();
+			check_duparg(&attrs, IFLA_PVAL_HUGEPAGE, "hugepage",
+				     *argv);
+			if (!matches(*argv, "on"))
+				addattr8(n, 1024, IFLA_PVAL_HUGEPAGE, 1);
+			else if (!matches(*argv, "off"))
+				addattr8(n, 1024, IFLA_PVAL_HUGEPAGE, 0);
+			else
+				invarg("invalid parameter", *argv);
+		} else if (!matches(*argv, "promisc")) {
+			NEXT_ARG();
+			check_duparg(&attrs, IFLA_PVAL_PROMISC, "promisc",
+				     *argv);
+			if (!matches(*argv, "on"))
+				addattr8(n, 1024, IFLA_PVAL_PROMISC, 1);
+			else if (!matches(*argv, "off"))
+				addattr8(n, 1024, IFLA_PVAL_PROMISC, 0);
+			else
+				invarg("invalid parameter", *argv);
+		} else if (!matches(*argv, "passive")) {
+			NEXT_ARG();
+			check_duparg(&attrs, IFLA_PVAL_PASSIVE, "passive",
+				     *argv);
+			if (!matches(*argv, "on"))
+				addattr8(n, 1024, IFLA_PVAL_PASSIVE, 1);
+			else if (!matches(*argv, "off"))
+				addattr8(n, 1024, IFLA_PVAL_PASSIVE, 0);
+			else
+				invarg("invalid parameter", *argv);
+		} else if (!matches(*argv, "txqstate")) {
+			NEXT_ARG();
+			check_duparg(&attrs, IFLA_PVAL_TXQSTATE, "txqstate",
+				     *argv);
+			if (!matches(*argv, "on"))
+				addattr8(n, 1024, IFLA_PVAL_TXQSTATE, 1);
+			else if (!matches(*argv, "off"))
+				addattr8(n, 1024, IFLA_PVAL_TXQSTATE, 0);
+			else
+				invarg("invalid parameter", *argv);
+		} else if (!matches(*argv, "wakeup")) {
+			NEXT_ARG();
+			check_duparg(&attrs, IFLA_PVAL_WAKEUP, "wakeup", *argv);
+			if (get_u32(&val, *argv, 0) || val == 0)
+				invarg("invalid wakeup", *argv);
+			addattr32(n, 1024, IFLA_PVAL_WAKEUP, val);
+		} else if (!matches(*argv, "busypoll")) {
+			NEXT_ARG();
+			check_duparg(&attrs, IFLA_PVAL_BUSYPOLL, "busypoll",
+				     *argv);
+			if (get_u32(&val, *argv, 0))
+				invarg("invalid busypoll", *argv);
+			addattr32(n, 1024, IFLA_PVAL_BUSYPOLL, val);
+		} else if (!matches(*argv, "layout")) {
+			NEXT_ARG();
+			check_duparg(&attrs, IFLA_PVAL_LAYOUT, "layout", *argv);
+			if (!matches(*argv, "slot"))
+				addattr8(n, 1024, IFLA_PVAL_LAYOUT,
+					 PVAL_LAYOUT_SLOT);
+			else if (!matches(*argv, "split"))
+				addattr8(n, 1024, IFLA_PVAL_LAYOUT,
+					 PVAL_LAYOUT_SPLIT);
+			else
+				invarg("invalid layout", *argv);
+		} else if (!matches(*argv, "gro")) {
+			NEXT_ARG();
+			check_duparg(&attrs, IFLA_PVAL_GRO, "gro", *argv);
+			if (!matches(*argv, "aggr"))
+				addattr8(n, 1024, IFLA_PVAL_GRO, PVAL_GRO_AGGR);
+			else if (!matches(*argv, "segs"))
+				addattr8(n, 1024, IFLA_PVAL_GRO, PVAL_GRO_SEGS);
+			else
+				invarg("invalid gro", *argv);
+		} else if (!matches(*argv, "tssrc")) {
+			NEXT_ARG();
+			check_duparg(&attrs, IFLA_PVAL_TSSRC, "tssrc", *argv);
+			if (!matches(*argv, "hw"))
+				addattr8(n, 1024, IFLA_PVAL_TSSRC, PVAL_TSSRC_HW);
+			else if (!matches(*argv, "sw"))
+				addattr8(n, 1024, IFLA_PVAL_TSSRC, PVAL_TSSRC_SW);
+			else if (!matches(*argv, "tsc"))
+				addattr8(n, 1024, IFLA_PVAL_TSSRC,
+					 PVAL_TSSRC_TSC);
+			else if (!matches(*argv, "xdp"))
+				addattr8(n, 1024, IFLA_PVAL_TSSRC,
+					 PVAL_TSSRC_XDP);
+			else
+				invarg("invalid tssrc", *argv);
+		} else if (!matches(*argv, "clkcorr")) {
+			NEXT_ARG();
+			check_duparg(&attrs, IFLA_PVAL_CLKCORR, "clkcorr",
+				     *argv);
+			if (get_u32(&val, *argv, 0))
+				invarg("invalid clkcorr", *argv);
+			addattr32(n, 1024, IFLA_PVAL_CLKCORR, val);
+		} else if (!matches(*argv, "pacegap")) {
+			NEXT_ARG();
+			check_duparg(&attrs, IFLA_PVAL_PACEGAP, "pacegap",
+				     *argv);
+			if (get_u32(&val, *argv, 0))
+				invarg("invalid pacegap", *argv);
+			addattr32(n, 1024, IFLA_PVAL_PACEGAP, val);
+		} else if (!matches(*argv, "pacerate")) {
+			NEXT_ARG();
+			check_duparg(&attrs, IFLA_PVAL_PACERATE, "pacerate",
+				     *argv);
+			if (get_u64(&val64, *argv, 0))
+				invarg("invalid pacerate", *argv);
+			addattr64(n, 1024, IFLA_PVAL_PACERATE, val64);
+		} else if (!matches(*argv, "pacemark")) {
+			NEXT_ARG();
+			check_duparg(&attrs, IFLA_PVAL_PACEMARK, "pacemark",
+				     *argv);
+			if (get_u32(&val, *argv, 0))
+				invarg("invalid pacemark", *argv);
+			addattr32(n, 1024, IFLA_PVAL_PACEMARK, val);
+		} else if (!matches(*argv, "burstwin")) {
+			NEXT_ARG();
+			check_duparg(&attrs, IFLA_PVAL_BURSTWIN, "burstwin",
+				     *argv);
+			if (get_u32(&val, *argv, 0))
+				invarg("invalid burstwin", *argv);
+			addattr32(n, 1024, IFLA_PVAL_BURSTWIN, val);
+		} else if (!matches(*argv, "burstbytes")) {
+			NEXT_ARG();
+			check_duparg(&attrs, IFLA_PVAL_BURSTBYTES, "burstbytes",
+				     *argv);
+			if (get_u32(&val, *argv, 0))
+				invarg("invalid burstbytes", *argv);
+			addattr32(n, 1024, IFLA_PVAL_BURSTBYTES, val);
+		} else if (!matches(*argv, "ringsize")) {
+			NEXT_ARG();
+			check_duparg(&attrs, IFLA_PVAL_RINGSIZE, "ringsize",
+				     *argv);
+			if (get_u32(&val, *argv, 0) || val < 16 ||
+			    (val & (val - 1)))
+				invarg("invalid ringsize", *argv);
+			addattr32(n, 1024, IFLA_PVAL_RINGSIZE, val);
+		} else if (!matches(*argv, "snaplen")) {
+			NEXT_ARG();
+			check_duparg(&attrs, IFLA_PVAL_SNAPLEN, "snaplen",
+				     *argv);
+			if (get_u32(&val, *argv, 0) || val > PVAL_PKT_LEN)
+				invarg("invalid snaplen", *argv);
+			addattr16(n, 1024, IFLA_PVAL_SNAPLEN, val);
+		} else if (!matches(*argv, "xdp")) {
+			NEXT_ARG();
+			check_duparg(&attrs, IFLA_PVAL_XDPFD, "xdp", *argv);
+			if (pval_xdp_parse(&argc, &argv, n))
+				return -1;
 		} else if (!matches(*argv, "help")) {
 			explain();
 			return -1;
@@ -132,6 +382,13 @@ static int pval_parse_opt(struct link_util *lu, int argc, char **argv,
 		argc--, argv++;
 	}
 
+	/* the first link is the primary, and all go to IFLA_PVAL_LINKS */
+	if (nlinks)
+		addattr32(n, 1024, IFLA_PVAL_LINK, links[0]);
+	if (nlinks > 1)
+		addattr_l(n, 1024, IFLA_PVAL_LINKS, links,
+			  nlinks * sizeof(__u32));
+
 	return 0;
 }
 
@@ -153,6 +410,23 @@ static void pval_print_opt(struct link_util *lu, FILE *f, struct rtattr *tb[])
 		}
 	}
 
+	if (tb[IFLA_PVAL_LINKS] &&
+	    RTA_PAYLOAD(tb[IFLA_PVAL_LINKS]) > sizeof(__u32)) {
+		__u32 *links = RTA_DATA(tb[IFLA_PVAL_LINKS]);
+		int i, nlinks = RTA_PAYLOAD(tb[IFLA_PVAL_LINKS]) /
+			sizeof(__u32);
+
+		open_json_array(PRINT_JSON, "links");
+		for (i = 0; i < nlinks; i++) {
+			print_string(PRINT_JSON, NULL, NULL,
+				     ll_index_to_name(links[i]));
+			if (i > 0)
+				print_string(PRINT_FP, NULL, "link %s ",
+					     ll_index_to_name(links[i]));
+		}
+		close_json_array(PRINT_JSON, NULL);
+	}
+
 	if (tb[IFLA_PVAL_IPOPT]) {
 		r = rta_getattr_u8(tb[IFLA_PVAL_IPOPT]) ? on : off;
 		print_string(PRINT_ANY, "ipopt", "ipopt %s ", r);
@@ -182,6 +456,142 @@ static void pval_print_opt(struct link_util *lu, FILE *f, struct rtattr *tb[])
 		r = rta_getattr_u8(tb[IFLA_PVAL_TXBUSYDROP]) ? on : off;
 		print_string(PRINT_ANY, "txbusydrop", "txbusydrop %s ", r);
 	}
+
+	if (tb[IFLA_PVAL_FLOWSEQ]) {
+		r = rta_getattr_u8(tb[IFLA_PVAL_FLOWSEQ]) ? on : off;
+		print_string(PRINT_ANY, "flowseq", "flowseq %s ", r);
+	}
+
+	if (tb[IFLA_PVAL_IPOPTTS]) {
+		print_uint(PRINT_ANY, "ipoptts", "ipoptts %u ",
+			   rta_getattr_u8(tb[IFLA_PVAL_IPOPTTS]));
+	}
+
+	if (tb[IFLA_PVAL_CARRIER]) {
+		switch (rta_getattr_u8(tb[IFLA_PVAL_CARRIER])) {
+		case PVAL_CARRIER_IPOPT:
+			r = "ipopt";
+			break;
+		case PVAL_CARRIER_TRAILER:
+			r = "trailer";
+			break;
+		case PVAL_CARRIER_UDP:
+			r = "udp";
+			break;
+		default:
+			r = "unknown";
+		}
+		print_string(PRINT_ANY, "carrier", "carrier %s ", r);
+	}
+
+	if (tb[IFLA_PVAL_UDPPORT]) {
+		print_uint(PRINT_ANY, "udpport", "udpport %u ",
+			   rta_getattr_u16(tb[IFLA_PVAL_UDPPORT]));
+	}
+
+	if (tb[IFLA_PVAL_HUGEPAGE]) {
+		r = rta_getattr_u8(tb[IFLA_PVAL_HUGEPAGE]) ? on : off;
+		print_string(PRINT_ANY, "hugepage", "hugepage %s ", r);
+	}
+
+	if (tb[IFLA_PVAL_PROMISC]) {
+		r = rta_getattr_u8(tb[IFLA_PVAL_PROMISC]) ? on : off;
+		print_string(PRINT_ANY, "promisc", "promisc %s ", r);
+	}
+
+	if (tb[IFLA_PVAL_PASSIVE]) {
+		r = rta_getattr_u8(tb[IFLA_PVAL_PASSIVE]) ? on : off;
+		print_string(PRINT_ANY, "passive", "passive %s ", r);
+	}
+
+	if (tb[IFLA_PVAL_TXQSTATE]) {
+		r = rta_getattr_u8(tb[IFLA_PVAL_TXQSTATE]) ? on : off;
+		print_string(PRINT_ANY, "txqstate", "txqstate %s ", r);
+	}
+
+	if (tb[IFLA_PVAL_WAKEUP]) {
+		print_uint(PRINT_ANY, "wakeup", "wakeup %u ",
+			   rta_getattr_u32(tb[IFLA_PVAL_WAKEUP]));
+	}
+
+	if (tb[IFLA_PVAL_BUSYPOLL]) {
+		print_uint(PRINT_ANY, "busypoll", "busypoll %u ",
+			   rta_getattr_u32(tb[IFLA_PVAL_BUSYPOLL]));
+	}
+
+	if (tb[IFLA_PVAL_LAYOUT]) {
+		r = rta_getattr_u8(tb[IFLA_PVAL_LAYOUT]) == PVAL_LAYOUT_SPLIT ?
+			"split" : "slot";
+		print_string(PRINT_ANY, "layout", "layout %s ", r);
+	}
+
+	if (tb[IFLA_PVAL_GRO]) {
+		r = rta_getattr_u8(tb[IFLA_PVAL_GRO]) == PVAL_GRO_SEGS ?
+			"segs" : "aggr";
+		print_string(PRINT_ANY, "gro", "gro %s ", r);
+	}
+
+	if (tb[IFLA_PVAL_TSSRC]) {
+		switch (rta_getattr_u8(tb[IFLA_PVAL_TSSRC])) {
+		case PVAL_TSSRC_SW:
+			r = "sw";
+			break;
+		case PVAL_TSSRC_TSC:
+			r = "tsc";
+			break;
+		case PVAL_TSSRC_XDP:
+			r = "xdp";
+			break;
+		default:
+			r = "hw";
+		}
+		print_string(PRINT_ANY, "tssrc", "tssrc %s ", r);
+	}
+
+	if (tb[IFLA_PVAL_CLKCORR]) {
+		print_uint(PRINT_ANY, "clkcorr", "clkcorr %u ",
+			   rta_getattr_u32(tb[IFLA_PVAL_CLKCORR]));
+	}
+
+	if (tb[IFLA_PVAL_XDP]) {
+		r = rta_getattr_u8(tb[IFLA_PVAL_XDP]) ? on : off;
+		print_string(PRINT_ANY, "xdp", "xdp %s ", r);
+	}
+
+	if (tb[IFLA_PVAL_PACEGAP]) {
+		print_uint(PRINT_ANY, "pacegap", "pacegap %u ",
+			   rta_getattr_u32(tb[IFLA_PVAL_PACEGAP]));
+	}
+
+	if (tb[IFLA_PVAL_PACERATE]) {
+		print_u64(PRINT_ANY, "pacerate", "pacerate %llu ",
+			  rta_getattr_u64(tb[IFLA_PVAL_PACERATE]));
+	}
+
+	if (tb[IFLA_PVAL_PACEMARK]) {
+		print_uint(PRINT_ANY, "pacemark", "pacemark %u ",
+			   rta_getattr_u32(tb[IFLA_PVAL_PACEMARK]));
+	}
+
+	if (tb[IFLA_PVAL_BURSTWIN]) {
+		print_uint(PRINT_ANY, "burstwin", "burstwin %u ",
+			   rta_getattr_u32(tb[IFLA_PVAL_BURSTWIN]));
+	}
+
+	if (tb[IFLA_PVAL_BURSTBYTES]) {
+		print_uint(PRINT_ANY, "burstbytes", "burstbytes %u ",
+			   rta_getattr_u32(tb[IFLA_PVAL_BURSTBYTES]));
+	}
+
+	if (tb[IFLA_PVAL_RINGSIZE]) {
+		print_uint(PRINT_ANY, "ringsize", "ringsize %u ",
+			   rta_getattr_u32(tb[IFLA_PVAL_RINGSIZE]));
+	}
+
+	if (tb[IFLA_PVAL_SNAPLEN]) {
+		print_uint(PRINT_ANY, "snaplen", "snaplen %u ",
+			   rta_getattr_u16(tb[IFLA_PVAL_SNAPLEN]));
+	}
 }
 
 static void pval_print_help(struct link_util *lu, int argc, char **argv,
@@ -6,24 +6,48 @@
 #include <linux/err.h>
 #include <linux/rculist.h>
 #include <linux/etherdevice.h>
+#include <linux/if_vlan.h>
+#include <linux/ipv6.h>
+#include <linux/udp.h>
+#include <linux/bpf.h>
+#include <linux/filter.h>
 #include <net/net_namespace.h>
 #include <net/netns/generic.h>
 #include <net/rtnetlink.h>
 #include <net/genetlink.h>
 #include <net/ip_tunnels.h>
+#include <net/sch_generic.h>
+#include <net/tcp.h>
 #include <linux/miscdevice.h>
 #include <linux/poll.h>
 #include <linux/wait.h>
+#include <linux/uio.h>
+#include <linux/refcount.h>
+#include <linux/ethtool.h>
+#include <linux/ptp_clock.h>
+#include <linux/timekeeping.h>
+#include <linux/seqlock.h>
+#include <linux/sched/signal.h>
+#include <linux/sched/clock.h>
 #include <uapi/linux/limits.h>
 #include <uapi/linux/if.h>
 #include <uapi/linux/net_tstamp.h>
 #include <asm/string.h>
+#include <asm/timex.h>
+#include <asm/unaligned.h>
 
 #include <pval.h>
 
+#define CREATE_TRACE_POINTS
+#include "pval_trace.h"
+
 #define PVAL_VERSION 	"0.0.1"
 #define DRV_NAME	"pval"
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 20, 0)
+#define iov_iter_type(i)	((i)->type & ~(READ | WRITE))
+#endif
+
 #undef pr_fmt
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 
@@ -33,19 +57,88 @@ const static struct net_device_ops pdev_netdev_ops;
 
 /* structures describing pval ring buffer */
 struct pval_ring {
+	struct pval_mdev *pmdev;	/* owner */
 	u8	cpu;
+	u8	dir;	/* PVAL_DIR_* */
 	u32	head;	/* write point */
 	u32	tail;	/* read point */
 	u32	mask;	/* bit mask of the ring buffer */
+	u8	layout;	/* PVAL_LAYOUT_* */
+	u32	clk_gen[PVAL_MAX_LINKS];	/* pval_link->clk_gen written */
+
+	bool	overwrite;	/* drop the oldest record instead of new */
+	bool	frozen;		/* stop recording and keep the contents */
+	atomic_t overrun;	/* records overwritten since the last read */
+	u32	drops;		/* records dropped since the last written */
+	u64	drop_ts;	/* pval_now() of the first of drops */
+
+	/* hugepage-backed ring. slots, or descs and payload, are in
+	 * the huge page after hdr, and the page can be mmap()ed. The
+	 * owner (pmdev) and each VMA hold ref, and the ring is freed
+	 * when the last of them is gone. mapped is kept while mmaps > 0
+	 * under map_lock.
+	 */
+	struct page		*page;
+	struct pval_mmap_hdr	*hdr;
+	bool			mapped;	/* reader advances hdr->tail */
+	int			mmaps;	/* VMAs mapping page */
+	spinlock_t		map_lock;
+	refcount_t		ref;
 
 	struct pval_slot *slots;	/* array of pval slot */
+
+	/* PVAL_LAYOUT_SPLIT */
+	struct pval_desc *descs;	/* array of pval desc */
+	char		 *payload;	/* PVAL_PKT_LEN bytes for each desc */
+
+	struct rcu_head	rcu;
 };
-#define PVAL_SLOT_NUM	1024	/* length of a ring (num of slots) */
+#define PVAL_SLOT_NUM	1024	/* default length of a ring (num of slots) */
+#define PVAL_RING_MIN	16
+#define PVAL_RING_MAX	65536
+#define PVAL_HPAGE_ORDER	(PMD_SHIFT - PAGE_SHIFT)
 
 
 
 /* structure describing pval misc device. TX/RX on per CPU */
 #define PVAL_NAME_MAX	(IFNAMSIZ + 16)
+/* microburst detector of a ring. Windows are fixed and start at the
+ * first packet after the previous window. Times are packet timestamps
+ * (pval_tstamp()) in nsec of tssrc.
+ */
+struct pval_bdet {
+	u64	win_start;
+	u32	win_bytes;
+	u32	win_pkts;
+
+	u64	start;		/* of the current burst, 0 is none */
+	u64	last;		/* last packet */
+	u64	bytes;
+	u32	pkts;
+	u32	windows;
+	u8	tssrc;		/* PVAL_TSSRC_* of start and last */
+	u32	seen;		/* pkts + win_pkts at the last idle check */
+
+	/* top talker by majority vote on bytes */
+	u32	cand;
+	s64	cand_bytes;
+};
+#define PVAL_BURST_IDLE_MIN	NSEC_PER_MSEC
+
+/* encoder state of the delta stream (PVAL_IOC_DELTA) of a reader */
+#define PVAL_DELTA_BUF		512
+#define PVAL_DELTA_PAYLOAD	sizeof(struct pval_burst) /* longest T_REC */
+
+struct pval_delta {
+	bool	on;
+	u64	base;		/* tstamp of the last packet or sync */
+	u32	cnt;		/* records since the last sync point */
+	u32	flows[PVAL_DELTA_FLOWS];
+	u32	len;		/* bytes encoded in buf */
+	u8	buf[PVAL_DELTA_BUF];
+	struct pval_slot bounce;	/* popped in overwrite mode */
+};
+
 struct pval_mdev {
 	struct pval_dev	*pdev;		/* parent */
 	char	name[PVAL_NAME_MAX];	/* IFNAM-{tx|rx}-cpu-%d */
@@ -55,8 +148,18 @@ struct pval_mdev {
 					 * to avoid race condition.
 					 */
 
-	struct pval_ring	ring;
+	/* producers write to ring under RCU. When the rings are
+	 * changed, the swapped-out ring is kept in old until the
+	 * reader drains it. lock serializes the reader and the swap.
+	 */
+	struct pval_ring __rcu	*ring;
+	struct pval_ring	*old;
+	struct mutex		lock;
 	struct miscdevice	mdev;
+	wait_queue_head_t	wait;	/* readers blocked on this ring */
+	struct pval_bdet	bdet;
+	struct hrtimer		burst_timer;	/* reports a burst at idle */
+	struct pval_delta	delta;
 
 	/* worker for retriving TX tstamp */
 	unsigned long		txtstamp_start;
@@ -65,30 +168,68 @@ struct pval_mdev {
 	spinlock_t		txtstamp_lock;
 };
 #define PVAL_TXTSTAMP_TIMEOUT	(HZ * 1)
+#define PVAL_TXTSTAMP_INFLIGHT	4096	/* max workers waiting per device */
 
 /* structure describing worker retrieving txtstamp from TXed skb */
 struct pval_worker {
 	struct work_struct	work;
 	struct sk_buff		*skb;
-	struct pval_ring	*ring;
+	struct pval_mdev	*pmdev;
 	unsigned long		start;
+	u64			start_ns;	/* for tracing latency */
 };
 
 
-/* waitqueue for poll */
-static DECLARE_WAIT_QUEUE_HEAD(pval_wait);
+/* per-flow sequence table. A flow is kept in one of PVAL_FLOW_WAYS
+ * entries of the set indexed by its hash, and the least recently used
+ * entry of the set is evicted (then seq of the flow restarts from 0).
+ */
+#define PVAL_FLOW_SETS	64
+#define PVAL_FLOW_WAYS	4
+
+struct pval_flow {
+	u32	hash;
+	u64	seq;
+	u64	last;	/* pval_pcpu->tick at last use, 0 is unused */
+};
+
+/* structure describing per-CPU state for TX */
+struct pval_pcpu {
+	u64	seq;	/* per CPU sequence */
+	u64	tick;	/* LRU clock of flows */
+	struct pval_flow flows[PVAL_FLOW_SETS][PVAL_FLOW_WAYS];
+};
 
 
 /* structure describing pval device */
 #define PVAL_MAX_CPUS	16
 
+/* lower link. pval enslaves one or more (LAG members) */
+struct pval_link {
+	struct net_device	*dev;
+	struct packet_type	tap;	/* ETH_P_ALL on this link in passive */
+
+	/* @original_config: config before pval manipulates */
+	struct hwtstamp_config	original_config;
+
+	/* PHC of this link for clock correlation records, under
+	 * pval_dev->clk_seq
+	 */
+	struct file		*phc;		/* /dev/ptpN, NULL if none */
+	int			phc_index;
+	struct pval_clock	clk;
+	u32			clk_gen;
+};
+
 struct pval_dev {
 	struct list_head	list;
 	struct rcu_head		rcu;
 	struct net_device	*dev;
 
 	struct net_device	*link;	/* underlay link this pval hiring */
-	u64 __percpu		 seq;	/* sequence for TXed packets */
+	struct pval_link	links[PVAL_MAX_LINKS];	/* link is links[0] */
+	int			num_links;
+	struct pval_pcpu __percpu *pcpu; /* sequence for TXed packets */
 
 	/* on/off switches for functionalities */
 	bool ipopt;
@@ -97,19 +238,105 @@ struct pval_dev {
 	bool txcopy;
 	bool rxcopy;
 	bool txbusydrop;
+	bool flowseq;
+	u8 ipoptts;	/* 0, 32 or 64: bits of tstamp in IP option */
+	u8 carrier;	/* PVAL_CARRIER_* */
+	u16 udpport;	/* dst port of PVAL_CARRIER_UDP */
+	bool hugepage;	/* rings are on huge pages */
+	bool promisc;	/* lower link in promisc instead of uc filter */
+	bool passive;	/* tap lower link by ptype instead of rx_handler */
+	bool txqstate;	/* record lower TX queue state in TX records */
+
+	/* microburst detector, off when burstwin is 0 */
+	u32 burstwin;	/* nsec */
+	u32 burstbytes;
+	bool xdp;	/* XDP prog is attached to the lower link by us */
+
+	/* TX pacing. Departure times are spaced by pacegap or pacerate,
+	 * and given to the lower qdisc in skb->tstamp, or held in pace_q
+	 * until pace_timer fires when the qdisc does not pace.
+	 */
+	u32			pacegap;	/* nsec, 0 is off */
+	u64			pacerate;	/* bits per sec, 0 is off */
+	u32			pacemark;	/* skb->mark to pace, 0 is all */
+	u8			pace_mode;	/* PVAL_PACE_* */
+	atomic64_t		pace_next;	/* CLOCK_MONOTONIC nsec */
+	struct sk_buff_head	pace_q;
+	struct hrtimer		pace_timer;
+
+	/* blocking read parameters */
+	u32 wakeup;	/* wake up readers when this num of pkts queued */
+	u32 busypoll;	/* usecs to spin on empty ring before sleeping */
+
+	u8 layout;	/* PVAL_LAYOUT_* of rings */
+	u32 ringsize;	/* num of slots of rings */
+	u16 snaplen;	/* bytes of a packet copied, up to PVAL_PKT_LEN */
+	u8 gro;		/* PVAL_GRO_* */
+	u8 tssrc;	/* PVAL_TSSRC_* */
+	bool hwtstamp_ok;	/* lower link accepted hwtstamp config */
+
+	/* workers waiting for TX hwtstamps run on wq. dying stops new
+	 * workers and makes queued ones release their clones without
+	 * waiting, so that pval_uninit() drains wq in bounded time.
+	 */
+	struct workqueue_struct	*wq;
+	atomic_t		txtstamp_inflight;
+	bool			dying;
 
-	/* @original_config: config before pval manipulates */
-	struct hwtstamp_config original_config;
+	/* clock correlation records. clk_work samples the PHC of each
+	 * lower link, and producers put the latest sample of the link of
+	 * a packet into their rings when clk_gen of the link is updated.
+	 */
+	u32			clkcorr;	/* period in msec, 0 is off */
+	struct delayed_work	clk_work;
+	seqcount_t		clk_seq;
 
-	/* misc device structures */
+	/* misc device structures. mmap() fails while swapping */
 	int num_cpus;
+	bool swapping;
 	struct pval_mdev txmdevs[PVAL_MAX_CPUS];
 	struct pval_mdev rxmdevs[PVAL_MAX_CPUS];
 };
-#define pdev_tx_ring(pdev) (&((pdev)->txmdevs[smp_processor_id()].ring))
-#define pdev_rx_ring(pdev) (&((pdev)->rxmdevs[smp_processor_id()].ring))
+/* producers run in the RX handler and xmit (RCU-bh read side), and
+ * readers and the ring swap hold pmdev->lock.
+ */
+#define pmdev_ring(pmdev)						\
+	rcu_dereference_check((pmdev)->ring,				\
+			      rcu_read_lock_bh_held() ||		\
+			      lockdep_is_held(&(pmdev)->lock))
 #define pdev_tx_pmdev(pdev) (&((pdev)->txmdevs[smp_processor_id()]))
 #define pdev_rx_pmdev(pdev) (&((pdev)->rxmdevs[smp_processor_id()]))
+#define pdev_tx_ring(pdev) pmdev_ring(pdev_tx_pmdev(pdev))
+#define pdev_rx_ring(pdev) pmdev_ring(pdev_rx_pmdev(pdev))
+#define pval_for_each_link(pdev, pl)					\
+	for ((pl) = (pdev)->links;					\
+	     (pl) < (pdev)->links + (pdev)->num_links; (pl)++)
+
+/* how paced departure times are enforced */
+enum {
+	PVAL_PACE_TIMER,	/* pace_q and pace_timer in pval */
+	PVAL_PACE_FQ,		/* lower fq qdisc, skb->tstamp in MONOTONIC */
+	PVAL_PACE_ETF,		/* lower etf qdisc, skb->tstamp in TAI */
+};
+
+/* state of a packet at xmit, in cb of the skb and its clone */
+struct pval_skb_cb {
+	u64	tstamp;	/* software timestamp at xmit */
+	u64	seq;	/* of inserted Pval IP Option, for tracing */
+	u64	sched;	/* paced departure, CLOCK_MONOTONIC nsec, 0 is none */
+
+	/* lower TX queue picked by the stack, and its state before
+	 * the packet is queued (txqstate on). Only in the clone.
+	 */
+	bool	txq_ok;
+	u16	txq;
+	u32	inflight;
+	u32	backlog;
+};
+#define PVAL_SKB_CB(skb) ((struct pval_skb_cb *)(skb)->cb)
+
+#define PVAL_WAKEUP_DEFAULT	1
+#define PVAL_WAKEUP_TIMEOUT	(HZ / 10)	/* max latency of wakeup */
 
 /* netns parameters */
 static unsigned int pval_net_id;
@@ -124,624 +351,3258 @@ struct pval_net {
 
 
 /* ring operations */
+/* head is written by the producer and tail by the reader, which
+ * may run on different CPUs. Slots are published by store-release of
+ * head and released by store-release of tail. A mmap()ed ring is
+ * released by the reader through hdr->tail instead.
+ */
+static inline u32 ring_tail(const struct pval_ring *r)
+{
+	if (READ_ONCE(r->mapped))
+		return smp_load_acquire(&r->hdr->tail) & r->mask;
+	return smp_load_acquire(&r->tail);
+}
+
 static inline bool ring_emtpy(const struct pval_ring *r)
 {
-	return (r->head == r->tail);
+	return (smp_load_acquire(&r->head) == ring_tail(r));
 }
 
 static inline bool ring_full(const struct pval_ring *r)
 {
-	return (((r->head + 1) & r->mask) == r->tail);
+	return (((r->head + 1) & r->mask) == ring_tail(r));
 }
 
 static inline void ring_write_next(struct pval_ring *r)
 {
-	r->head = (r->head + 1) & r->mask;
+	smp_store_release(&r->head, (r->head + 1) & r->mask);
+	if (r->hdr)
+		smp_store_release(&r->hdr->head, r->head);
 }
 
 static inline void ring_read_next(struct pval_ring *r)
 {
-	r->tail = (r->tail + 1) & r->mask;
+	smp_store_release(&r->tail, (r->tail + 1) & r->mask);
+	if (r->hdr)
+		smp_store_release(&r->hdr->tail, r->tail);
 }
 
 static inline u32 ring_read_avail(const struct pval_ring *r)
 {
-	if (r->head > r->tail)
-		return r->head - r->tail;
-	if (r->tail > r->head)
-		return r->mask - r->tail + r->head + 1;
+	u32 head = smp_load_acquire(&r->head);
+	u32 tail = ring_tail(r);
+
+	if (head > tail)
+		return head - tail;
+	if (tail > head)
+		return r->mask - tail + head + 1;
 	return 0;	// empty
 }
 
 static inline u32 ring_write_avail(const struct pval_ring *r)
 {
-	if (r->tail > r->head)
-		return r->tail - r->head;
-	if (r->head > r->tail)
-		return r->mask - r->head + r->tail + 1;
-	return 0;	// full
+	/* a ring holds mask slots at most; one slot is always empty */
+	return r->mask - ring_read_avail(r);
 }
 
 static inline void ring_zero(struct pval_ring *r)
 {
 	r->head = 0;
 	r->tail = 0;
+	r->overwrite = false;
+	r->frozen = false;
+	atomic_set(&r->overrun, 0);
+	r->drops = 0;
+	r->drop_ts = 0;
+	if (r->hdr) {
+		r->hdr->head = 0;
+		r->hdr->tail = 0;
+	}
 }
 
-static inline ssize_t write_to_ring(struct pval_ring *r, struct sk_buff *skb)
+/* make a free slot at head. In overwrite mode, the oldest record is
+ * dropped by pushing tail, which races with the reader. See
+ * ring_pop_slot().
+ */
+static inline void ring_trace_full(struct pval_ring *r)
 {
-	u32 pktlen = skb->mac_len + skb->len;
-	u32 copylen = pktlen > PVAL_PKT_LEN ? PVAL_PKT_LEN : pktlen;
-	struct pval_slot *s;
+	struct pval_mdev *pmdev = r->pmdev;
 
-	if (ring_full(r))
-		return 0;
+	if (trace_ring_full_enabled())
+		trace_ring_full(pmdev->pdev->dev, r->cpu, r->dir,
+				ring_read_avail(r), READ_ONCE(r->frozen));
+}
 
-	s = &r->slots[r->head];
+static inline bool __ring_reserve(struct pval_ring *r)
+{
+	u32 tail;
 
-	s->len = copylen;
-	s->pktlen = pktlen;
-	s->tstamp = skb_hwtstamps(skb)->hwtstamp;
-	memcpy(s->pkt, skb_mac_header(skb), copylen);
-	ring_write_next(r);
+	if (unlikely(READ_ONCE(r->frozen))) {
+		ring_trace_full(r);
+		return false;
+	}
 
-	return copylen;
+	if (!ring_full(r))
+		return true;
+
+	if (!READ_ONCE(r->overwrite)) {
+		ring_trace_full(r);
+		return false;
+	}
+
+	tail = (r->head + 1) & r->mask;
+	if (cmpxchg(&r->tail, tail, (tail + 1) & r->mask) == tail)
+		atomic_inc(&r->overrun);
+
+	/* otherwise the reader has just consumed the oldest one */
+	return true;
 }
 
-static void pval_txtstamp_work(struct work_struct *work)
+/* Copy the oldest record out of an overwrite mode ring. The producer
+ * may push tail past the record while it is copied, then the copy is
+ * stale and retried with the new oldest record.
+ */
+static bool ring_pop_slot(struct pval_ring *r, struct pval_slot *s)
 {
-	struct pval_mdev *pmdev = container_of(work, struct pval_mdev,
-					       txtstamp_work);
-	bool timeout = time_is_before_jiffies(pmdev->txtstamp_start +
-					      PVAL_TXTSTAMP_TIMEOUT);
-
-	if (unlikely(!pmdev->cloned_skb))
-		return;
+	u32 tail;
 
-	if (skb_hwtstamps(pmdev->cloned_skb)->hwtstamp != 0) {
-		if (pmdev->pdev->txcopy && pmdev->opened)
-			write_to_ring(&pmdev->ring, pmdev->cloned_skb);
-		kfree_skb(pmdev->cloned_skb);
-		pmdev->cloned_skb = NULL;
-		//spin_unlock(&pmdev->txtstamp_lock);		
-		return;
-	}
+	do {
+		if (ring_emtpy(r))
+			return false;
+		tail = READ_ONCE(r->tail);
+		*s = r->slots[tail];
+	} while (cmpxchg(&r->tail, tail, (tail + 1) & r->mask) != tail);
 
-	if (timeout) {
-		pr_err("retrieving txtstamp timeout on %s\n", pmdev->name);
-		kfree_skb(pmdev->cloned_skb);
-		pmdev->cloned_skb = NULL;
-		//spin_unlock(&pmdev->txtstamp_lock);
+	return true;
+}
 
-	} else {
-		/* reschedule to keep checking */
-		pr_info("%s: reschedule\n", __func__);
-		schedule_work(&pmdev->txtstamp_work);
-	}
+static bool ring_pop_desc(struct pval_ring *r, struct pval_desc *d,
+			  char *pkt)
+{
+	u32 tail;
+
+	do {
+		if (ring_emtpy(r))
+			return false;
+		tail = READ_ONCE(r->tail);
+		*d = r->descs[tail];
+		memcpy(pkt, r->payload + tail * PVAL_PKT_LEN,
+		       min_t(u32, d->caplen, PVAL_PKT_LEN));
+	} while (cmpxchg(&r->tail, tail, (tail + 1) & r->mask) != tail);
+
+	return true;
 }
 
-static void pval_txtstamp_work2(struct work_struct *work)
+static inline void ring_wake_reader(struct pval_ring *r)
 {
-	/* XXX: use independent workqueue (not kqueue).  this may
-	 * causes segfault when kmod is removed and the workers left.
-	 */
+	struct pval_mdev *pmdev = r->pmdev;
 
-	struct pval_worker *worker = container_of(work, struct pval_worker,
-						  work);
-	bool timeout = time_is_before_jiffies(worker->start +
-					      PVAL_TXTSTAMP_TIMEOUT);
+	/* wq_has_sleeper() keeps the datapath free of waitqueue
+	 * locking while nobody is blocked on this ring.
+	 */
+	if (wq_has_sleeper(&pmdev->wait) &&
+	    ring_read_avail(r) >= pmdev->pdev->wakeup)
+		wake_up_interruptible_poll(&pmdev->wait, POLLIN | POLLRDNORM);
+}
 
-	if (skb_hwtstamps(worker->skb)->hwtstamp != 0) {
-		write_to_ring(worker->ring, worker->skb);
-		kfree_skb(worker->skb);
-		kfree(worker);
+static void pval_destroy_ring(struct pval_ring *ring)
+{
+	if (ring->page) {
+		__free_pages(ring->page, PVAL_HPAGE_ORDER);
 		return;
 	}
 
-	if (timeout) {
-		kfree_skb(worker->skb);;
-	} else {
-		pr_info("%s: reschedule\n", __func__);
-		schedule_work(&worker->work);
-	}
+	kvfree(ring->slots);
+	kvfree(ring->descs);
+	kvfree(ring->payload);
 }
 
-static int pval_file_open(struct inode *inode, struct file *filp)
+static void pval_free_ring_rcu(struct rcu_head *head)
 {
-	int cpu, n;
-	char devname[IFNAMSIZ], direct[16], buf[PVAL_NAME_MAX];
-	struct net_device *dev;
-	struct pval_dev *pdev;
-	struct pval_mdev *pmdev;
+	struct pval_ring *ring = container_of(head, struct pval_ring, rcu);
 
-	/* copy and change chardev to be capable of sscanf */
-	strncpy(buf, filp->f_path.dentry->d_name.name, PVAL_NAME_MAX);
-	for (n = 0; n < strlen(buf); n++) {
-		if (buf[n] == '-')
-			buf[n] = ' ';
-	}
-	if (sscanf(buf, "%s %s cpu %d", devname, direct, &cpu) < 1) {
-		pr_err("%s: failed to parse char dev %s\n",
-		       __func__, filp->f_path.dentry->d_name.name);
-		return -EINVAL;
-	}
+	pval_destroy_ring(ring);
+	kfree(ring);
+}
 
-	dev = __dev_get_by_name(&init_net, devname); // Do not dev_hold()
-	if (!dev) {
-		pr_err("netdevice %s not found\n", devname);
-		return -ENODEV;
-	}
+/* free a ring after lockless readers (poll, wait) leave it, and
+ * after the last VMA mapping it is closed.
+ */
+static void pval_put_ring(struct pval_ring *ring)
+{
+	if (refcount_dec_and_test(&ring->ref))
+		call_rcu(&ring->rcu, pval_free_ring_rcu);
+}
 
-	if (dev->netdev_ops != &pdev_netdev_ops) {
-		pr_err("%s is not pval interface\n", devname);
-		return -EINVAL;
-	}
+/* records in the swapped-out ring and the current one */
+static u32 pval_mdev_avail(struct pval_mdev *pmdev)
+{
+	struct pval_ring *old;
+	u32 avail;
 
-	pdev = netdev_priv(dev);
+	rcu_read_lock();
+	avail = ring_read_avail(rcu_dereference(pmdev->ring));
+	old = READ_ONCE(pmdev->old);
+	if (old)
+		avail += ring_read_avail(old);
+	rcu_read_unlock();
 
-	if (cpu > pdev->num_cpus) {
-		pr_err("invalid cpu number %d of %s\n", cpu,
-			filp->f_path.dentry->d_name.name);
-		return -EINVAL;
-	}
+	return avail;
+}
 
-	if (strncmp(direct, "tx", 2) == 0)
-		pmdev = &pdev->txmdevs[cpu];
-	else if (strncmp(direct, "rx", 2) == 0)
-		pmdev = &pdev->rxmdevs[cpu];
-	else {
-		pr_err("invalid direction %s of %s\n", direct,
-		       filp->f_path.dentry->d_name.name);
-		return -EINVAL;
-	}
+/* find Pval IP Option from a copied IP header */
+static const struct ipopt_pval *pval_find_ipopt(const struct iphdr *iph,
+						u32 len)
+{
+	const u8 *opt, *end;
 
-	if (pmdev->opened) {
-		pr_err("this miscdevice %s is already opened\n",
-		       filp->f_path.dentry->d_name.name);
-		return -EBUSY;
+	if (len < sizeof(*iph) || iph->ihl <= 5 || (iph->ihl << 2) > len)
+		return NULL;
+
+	opt = (const u8 *)(iph + 1);
+	end = (const u8 *)iph + (iph->ihl << 2);
+
+	while (opt < end) {
+		if (opt[0] == IPOPT_END)
+			break;
+		if (opt[0] == IPOPT_NOOP) {
+			opt++;
+			continue;
+		}
+		if (opt + 1 >= end || opt[1] < 2 || opt + opt[1] > end)
+			break;
+		if (opt[0] == IPOPT_PVAL && opt[1] >= sizeof(struct ipopt_pval))
+			return (const struct ipopt_pval *)opt;
+		opt += opt[1];
 	}
 
-	pmdev->opened = true;
-	ring_zero(&pmdev->ring);	// flush the ring
-	filp->private_data = pmdev;
+	return NULL;
+}
 
-	return 0;
+static inline bool pval_ipopt_valid(const struct ipopt_pval *ipp, u32 len)
+{
+	return (len >= IPOPT_PVAL_LEN_V0 && ipp->type == IPOPT_PVAL &&
+		ipp->length >= IPOPT_PVAL_LEN_V0 && ipp->length <= len);
 }
 
-static int
-pval_file_release(struct inode *inode, struct file *filp)
+static inline void pval_ipopt_txts(struct pval_meta *m,
+				   const struct ipopt_pval *ipp)
 {
-	struct pval_mdev *pmdev = (struct pval_mdev *)filp->private_data;
+	const struct ipopt_pval_v1 *ipp1 = (const struct ipopt_pval_v1 *)ipp;
 
-	ring_zero(&pmdev->ring);	// flush the ring
-	pmdev->opened = false;
-	filp->private_data = NULL;
-	return 0;
+	if (IPOPT_PVAL_VER(ipp->ver) < IPOPT_PVAL_V1)
+		return;
+
+	if (ipp->length >= IPOPT_PVAL_LEN_TS64) {
+		m->txts = ipp1->ts.ts64;
+		m->flags |= PVAL_META_F_TXTS;
+	} else if (ipp->length >= IPOPT_PVAL_LEN_TS32) {
+		m->txts = ipp1->ts.ts32;
+		m->flags |= PVAL_META_F_TXTS;
+	}
 }
 
-static ssize_t
-pval_file_read_iter(struct kiocb *iocb, struct iov_iter *iter)
+static void pval_meta_ipopt(struct pval_meta *m, const struct ipopt_pval *ipp,
+			    u8 carrier)
 {
-	ssize_t ret = 0;
-	size_t count = iter->nr_segs;
-	u32 avail, n, copylen, copynum;
-	struct file *filp = iocb->ki_filp;
-	struct pval_mdev *pmdev = (struct pval_mdev *)filp->private_data;
-	struct pval_ring *r = &pmdev->ring;
-	struct pval_slot *s;
+	m->cpu = ipp->cpu;
+	m->seq = ipp->seq;
+	m->carrier = carrier;
+	m->flags |= PVAL_META_F_IPOPT;
+	pval_ipopt_txts(m, ipp);
+}
 
-	if (unlikely(iter->type != ITER_IOVEC)) {
-		pr_err("unsupported iter type %d\n", iter->type);
-		return -EOPNOTSUPP;
-	}
+/* Pval IP Option in pval_trailer at the end of skb */
+static void pval_meta_trailer(struct pval_meta *m, struct sk_buff *skb)
+{
+	const struct ipopt_pval *ipp;
+	const struct pval_trailer *t;
+	struct ipopt_pval_v1 obuf;
+	struct pval_trailer tbuf;
 
-	if (ring_emtpy(r))
-		goto out;
+	if (skb_is_gso(skb) || skb->len < sizeof(*t))
+		return;
 
-	avail = ring_read_avail(r);
-	copynum = avail > count ? count : avail;
+	t = skb_header_pointer(skb, skb->len - sizeof(*t), sizeof(*t), &tbuf);
+	if (!t || t->magic != htonl(PVAL_TRAILER_MAGIC) ||
+	    t->length > sizeof(obuf) || t->length + sizeof(*t) > skb->len)
+		return;
 
-	for (n = 0; n < copynum ; n++) {
-		s = &r->slots[r->tail];
-		copylen = sizeof(struct pval_slot) > iter->iov[n].iov_len ?
-			iter->iov[n].iov_len : sizeof(struct pval_slot);
-		copy_to_user(iter->iov[n].iov_base, s, copylen);
-		ring_read_next(r);
-		ret++;
-	}
+	ipp = skb_header_pointer(skb, skb->len - sizeof(*t) - t->length,
+				 t->length, &obuf);
+	if (ipp && pval_ipopt_valid(ipp, t->length))
+		pval_meta_ipopt(m, ipp, PVAL_CARRIER_TRAILER);
+}
 
-out:
-	return ret;
+/* member link the packet came from or goes to */
+static inline int pval_skb_ifindex(const struct pval_ring *r,
+				   const struct sk_buff *skb)
+{
+	return r->dir == PVAL_DIR_RX ? skb->skb_iif : skb->dev->ifindex;
 }
 
-static unsigned int pval_file_poll(struct file *file, poll_table *wait)
+/* fill pval_meta from skb and its copied bytes (pkt) */
+static void pval_fill_meta(struct pval_meta *m, struct pval_ring *r,
+			   struct sk_buff *skb, const char *pkt, u32 copylen)
 {
-	struct pval_mdev *pmdev = (struct pval_mdev *)file->private_data;
+	struct pval_mdev *pmdev = r->pmdev;
+	struct pval_dev *pdev = pmdev->pdev;
+	int l3off = skb_network_header(skb) - skb_mac_header(skb);
+	const struct vlan_hdr *vhdr;
+	const struct udphdr *uh;
+	const struct iphdr *iph;
+	const struct ipv6hdr *ip6h;
+	const struct ipopt_pval *ipp;
+	__be16 proto = skb->protocol;
+
+	memset(m, 0, sizeof(*m));
+	m->dir = r->dir;
+	m->segs = 1;
+	m->hash = skb_get_hash(skb);
+	m->ifindex = pval_skb_ifindex(r, skb);
+
+	if (r->dir == PVAL_DIR_RX && skb_rx_queue_recorded(skb))
+		m->queue = skb_get_rx_queue(skb);
+	else
+		m->queue = skb_get_queue_mapping(skb);
+
+	if (skb_vlan_tag_present(skb)) {
+		m->vlan_tci = skb_vlan_tag_get(skb);
+		m->flags |= PVAL_META_F_VLAN;
+	} else if (eth_type_vlan(proto) && copylen >= ETH_HLEN + VLAN_HLEN) {
+		/* in-band tag, not offloaded */
+		vhdr = (const struct vlan_hdr *)(pkt + ETH_HLEN);
+		m->vlan_tci = ntohs(vhdr->h_vlan_TCI);
+		m->flags |= PVAL_META_F_VLAN;
+		proto = vhdr->h_vlan_encapsulated_proto;
+	}
+	m->proto = proto;
 
-	poll_wait(file, &pval_wait, wait);
-	if (!ring_emtpy(&pmdev->ring))
-		return POLLIN | POLLRDNORM;
+	if (pdev->carrier == PVAL_CARRIER_TRAILER)
+		pval_meta_trailer(m, skb);
 
-	return 0;
-}
+	if (r->dir == PVAL_DIR_TX && !pdev->passive &&
+	    PVAL_SKB_CB(skb)->sched) {
+		m->sched = ktime_to_ns(ktime_mono_to_real(
+				ns_to_ktime(PVAL_SKB_CB(skb)->sched)));
+		m->flags |= PVAL_META_F_SCHED;
+	}
 
-static const struct file_operations pval_fops = {
-	.owner		= THIS_MODULE,
-	.open		= pval_file_open,
-	.release	= pval_file_release,
-	.read_iter	= pval_file_read_iter,
-	.poll		= pval_file_poll,
-};
+	if (r->dir == PVAL_DIR_TX && !pdev->passive &&
+	    PVAL_SKB_CB(skb)->txq_ok) {
+		m->queue = PVAL_SKB_CB(skb)->txq;
+		m->inflight = PVAL_SKB_CB(skb)->inflight;
+		m->backlog = PVAL_SKB_CB(skb)->backlog;
+		m->xflags |= PVAL_META_X_TXQ;
+	}
 
+	if (l3off < ETH_HLEN || l3off >= copylen)
+		return;
 
-static int pval_init_ring(struct pval_ring *ring, int cpu)
-{
-	ring->cpu = cpu;
-	ring->head = 0;
-	ring->tail = 0;
-	ring->mask = PVAL_SLOT_NUM - 1;
-	ring->slots = kmalloc(sizeof(struct pval_slot) * PVAL_SLOT_NUM,
-			      GFP_KERNEL);
-	if (!ring->slots) {
-		pr_err("failed to kmalloc pval_slots for ring %d\n", cpu);
-		return -ENOMEM;
+	m->l3off = l3off;
+	m->flags |= PVAL_META_F_L3;
+
+	switch (ntohs(proto)) {
+	case ETH_P_IP:
+		iph = (const struct iphdr *)(pkt + l3off);
+		if (l3off + sizeof(*iph) > copylen || iph->ihl < 5)
+			break;
+		m->ipproto = iph->protocol;
+		m->l4off = l3off + (iph->ihl << 2);
+		m->flags |= PVAL_META_F_L4;
+
+		ipp = pval_find_ipopt(iph, copylen - l3off);
+		if (ipp) {
+			pval_meta_ipopt(m, ipp, PVAL_CARRIER_IPOPT);
+			break;
+		}
+
+		if (pdev->carrier != PVAL_CARRIER_UDP ||
+		    iph->protocol != IPPROTO_UDP ||
+		    m->l4off + sizeof(*uh) > copylen)
+			break;
+
+		uh = (const struct udphdr *)(pkt + m->l4off);
+		ipp = (const struct ipopt_pval *)(uh + 1);
+		if (ntohs(uh->dest) == pdev->udpport &&
+		    pval_ipopt_valid(ipp, copylen - m->l4off - sizeof(*uh)))
+			pval_meta_ipopt(m, ipp, PVAL_CARRIER_UDP);
+		break;
+
+	case ETH_P_IPV6:
+		ip6h = (const struct ipv6hdr *)(pkt + l3off);
+		if (l3off + sizeof(*ip6h) > copylen)
+			break;
+		m->ipproto = ip6h->nexthdr;
+		m->l4off = l3off + sizeof(*ip6h);
+		m->flags |= PVAL_META_F_L4;
+		break;
 	}
+}
 
-	return 0;
+static inline bool pval_use_hwtstamp(const struct pval_dev *pdev)
+{
+	return pdev->tssrc == PVAL_TSSRC_HW && pdev->hwtstamp_ok;
 }
 
-static void pval_destroy_ring(struct pval_ring *ring)
+/* software or TSC timestamp taken on the datapath */
+static inline u64 pval_now(const struct pval_dev *pdev)
 {
-	kfree(ring->slots);
+	if (pdev->tssrc == PVAL_TSSRC_TSC)
+		return get_cycles();
+	return ktime_get_real_ns();
 }
 
-static int pval_init_miscdevice(struct pval_dev *pdev, struct pval_mdev *pmdev,
-				char *name, int cpu)
+/* pval_xdp_meta put by the XDP program on the lower link, or NULL */
+static inline struct pval_xdp_meta *pval_xdp_meta(struct sk_buff *skb)
 {
-	int rc;
+	struct pval_xdp_meta *xm;
 
-	strncpy(pmdev->name, name, PVAL_NAME_MAX);
-	pmdev->pdev		= pdev;
-	pmdev->cpu		= cpu;
-	pmdev->opened		= false;
-	pmdev->cloned_skb	= NULL;
-	pmdev->mdev.name	= pmdev->name;
-	pmdev->mdev.minor	= MISC_DYNAMIC_MINOR;
-	pmdev->mdev.fops	= &pval_fops;
+	if (skb_metadata_len(skb) != sizeof(*xm))
+		return NULL;
 
-	rc = pval_init_ring(&pmdev->ring, cpu);
-	if (rc < 0) {
-		pr_err("failed to init ring on cpu %d for %s\n", cpu, name);
-		goto err_out;
+	xm = skb_metadata_end(skb) - sizeof(*xm);
+	if (xm->magic != PVAL_XDP_MAGIC)
+		return NULL;
+
+	return xm;
+}
+
+/* timestamp of a record and which source it came from. Hardware
+ * and XDP timestamps fall back to software when the NIC or the XDP
+ * program did not stamp it.
+ */
+static inline u64 pval_tstamp(struct pval_ring *r, struct sk_buff *skb,
+			      u8 *tssrc)
+{
+	struct pval_mdev *pmdev = r->pmdev;
+	struct pval_dev *pdev = pmdev->pdev;
+	struct pval_xdp_meta *xm;
+
+	*tssrc = pdev->tssrc;
+	if (*tssrc == PVAL_TSSRC_XDP) {
+		xm = r->dir == PVAL_DIR_RX ? pval_xdp_meta(skb) : NULL;
+		if (xm)
+			return ktime_to_ns(ktime_mono_to_real(ns_to_ktime(xm->tstamp)));
+		*tssrc = PVAL_TSSRC_SW;
 	}
 
-	rc = misc_register(&pmdev->mdev);
-	if (rc < 0) {
-		pr_err("failed to register misc device %s\n", name);
-		goto err_misc_dev;
+	if (*tssrc == PVAL_TSSRC_HW) {
+		if (skb_hwtstamps(skb)->hwtstamp)
+			return ktime_to_ns(skb_hwtstamps(skb)->hwtstamp);
+		*tssrc = PVAL_TSSRC_SW;
 	}
 
-	INIT_WORK(&pmdev->txtstamp_work, pval_txtstamp_work);
-	spin_lock_init(&pmdev->txtstamp_lock);
+	/* skbs tapped in passive mode are shared, cb is not ours */
+	if (r->dir == PVAL_DIR_TX && !pdev->passive)
+		return PVAL_SKB_CB(skb)->tstamp;
 
-	pr_info("%s is registered \n", pmdev->name);
+	if (*tssrc == PVAL_TSSRC_SW && skb->tstamp)
+		return ktime_to_ns(skb->tstamp);
 
-	return 0;
+	return pval_now(pdev);
+}
 
-err_misc_dev:
-	pval_destroy_ring(&pmdev->ring);
+static inline char *ring_pkt(struct pval_ring *r, u32 idx)
+{
+	if (r->layout == PVAL_LAYOUT_SPLIT)
+		return r->payload + idx * PVAL_PKT_LEN;
+	return r->slots[idx].pkt;
+}
 
-err_out:
-	return rc;
+/* fill the record at head. Packet bytes are already at ring_pkt() */
+static inline void ring_fill_record(struct pval_ring *r, u64 tstamp,
+				    u32 copylen, u32 pktlen,
+				    const struct pval_meta *m)
+{
+	struct pval_slot *s;
+	struct pval_desc *d;
+
+	if (r->layout == PVAL_LAYOUT_SPLIT) {
+		d = &r->descs[r->head];
+		d->tstamp = tstamp;
+		d->pktlen = pktlen;
+		d->caplen = copylen;
+		d->hash = m->hash;
+		d->off = 0;	/* filled in pval_read_descs() */
+		d->flags = 0;
+		d->cpu = m->cpu;
+		d->seq = m->seq;
+		if (m->flags & PVAL_META_F_IPOPT)
+			d->flags |= PVAL_DESC_F_IPOPT;
+		if (m->flags & PVAL_META_F_GSO)
+			d->flags |= PVAL_DESC_F_GSO;
+		d->flags |= m->tssrc << PVAL_DESC_F_TSSRC_SHIFT;
+		d->flags |= (m->type << PVAL_DESC_F_TYPE_SHIFT) &
+			PVAL_DESC_F_TYPE_MASK;
+		if (m->type & 0x4)
+			d->flags |= PVAL_DESC_F_TYPE_HI;
+		return;
+	}
+
+	s = &r->slots[r->head];
+	s->len = copylen;
+	s->pktlen = pktlen;
+	s->tstamp = tstamp;
+	s->meta = *m;
 }
 
+/* export a record through the pval_record tracepoint */
+static inline void ring_trace_record(struct pval_ring *r, u64 tstamp,
+				     u32 copylen, u32 pktlen,
+				     const struct pval_meta *m, const void *pkt)
+{
+	struct pval_mdev *pmdev = r->pmdev;
+
+	trace_pval_record(pmdev->pdev->dev, r->cpu, r->dir, tstamp, pktlen,
+			  m, pkt, copylen);
+}
 
-static void pval_destroy_miscdevice(struct pval_mdev *pmdev)
+/* records are built while the ring is read, or exported to BPF
+ * programs on the pval_record tracepoint. An unread ring builds them
+ * on the slot at head, which is never visible to readers.
+ */
+static inline bool pval_recording(const struct pval_mdev *pmdev)
 {
-	//cancel_work_sync(&pmdev->txtstamp_work);
-	//spin_unlock(&pmdev->txtstamp_lock);
-	misc_deregister(&pmdev->mdev);
-	pval_destroy_ring(&pmdev->ring);
+	return READ_ONCE(pmdev->opened) || trace_pval_record_enabled();
 }
 
 
+/* structure describing how to cut a GRO/GSO TCP skb into segments
+ * without linearizing nor segmenting the skb.
+ */
+struct pval_gso {
+	u16	l3off, l4off, hdrlen;
+	u16	gso_size, segs;
+	__be16	proto;
+	bool	fixedid;
+	u8	tcpflags;	/* of the aggregated skb */
+	u16	id;		/* of the aggregated skb */
+	u32	seq;		/* of the aggregated skb */
+	u32	paylen;		/* total TCP payload length */
+};
 
-/* misc from netmap pkt-gen */
-static uint16_t
-checksum(const void * data, uint16_t len, uint32_t sum)
+static bool pval_gso_init(struct pval_gso *g, struct sk_buff *skb,
+			  const char *pkt, u32 copylen, u32 pktlen,
+			  const struct pval_meta *m)
 {
-        const uint8_t *addr = data;
-        uint32_t i;
+	struct skb_shared_info *shinfo = skb_shinfo(skb);
+	const struct tcphdr *th;
+	const struct iphdr *iph;
+
+	if (!(shinfo->gso_type & (SKB_GSO_TCPV4 | SKB_GSO_TCPV6)))
+		return false;
+
+	if (!(m->flags & PVAL_META_F_L4) || m->ipproto != IPPROTO_TCP ||
+	    m->l4off + sizeof(*th) > copylen)
+		return false;
+
+	th = (const struct tcphdr *)(pkt + m->l4off);
+	g->hdrlen = m->l4off + (th->doff << 2);
+	if (g->hdrlen > copylen || g->hdrlen >= pktlen)
+		return false;
+
+	g->l3off = m->l3off;
+	g->l4off = m->l4off;
+	g->proto = m->proto;
+	g->gso_size = shinfo->gso_size;
+	g->paylen = pktlen - g->hdrlen;
+	g->segs = DIV_ROUND_UP(g->paylen, g->gso_size);
+	g->seq = ntohl(th->seq);
+	g->tcpflags = tcp_flag_byte(th);
+	g->fixedid = !!(shinfo->gso_type & SKB_GSO_TCP_FIXEDID);
+	g->id = 0;
+	if (g->proto == htons(ETH_P_IP)) {
+		iph = (const struct iphdr *)(pkt + g->l3off);
+		g->id = ntohs(iph->id);
+	}
 
-        /* Checksum all the pairs of bytes first... */
-        for (i = 0; i < (len & ~1U); i += 2) {
-                sum += (u_int16_t)ntohs(*((u_int16_t *)(addr + i)));
-                if (sum > 0xFFFF)
-                        sum -= 0xFFFF;
-        }
-        /*
-         * If there's a single byte left over, checksum it, too.
-         * Network byte order is big-endian, so the remaining byte is
-         * the high byte.
-         */
+	return true;
+}
 
-        if (i < len) {
-                sum += addr[i] << 8;
-                if (sum > 0xFFFF)
-                        sum -= 0xFFFF;
-        }
+/* build i-th segment into pkt from headers (hdr) and skb payload, in
+ * the same way as tcp_gso_segment(). TCP checksum is not updated.
+ */
+static u32 pval_gso_seg(const struct pval_gso *g, struct sk_buff *skb,
+			char *pkt, const char *hdr, u16 i, u32 *pktlen)
+{
+	u32 off = i * g->gso_size;
+	u32 seglen = min_t(u32, g->gso_size, g->paylen - off);
+	u32 copylen = min_t(u32, g->hdrlen + seglen, PVAL_PKT_LEN);
+	u8 tcpflags = g->tcpflags;
+	struct ipv6hdr *ip6h;
+	struct iphdr *iph;
+	struct tcphdr *th;
+
+	if (pkt != hdr) {
+		memcpy(pkt, hdr, g->hdrlen);
+		if (copylen > g->hdrlen &&
+		    skb_copy_bits(skb, skb_mac_offset(skb) + g->hdrlen + off,
+				  pkt + g->hdrlen, copylen - g->hdrlen) < 0)
+			copylen = g->hdrlen;
+	}
+	*pktlen = g->hdrlen + seglen;
+
+	if (g->proto == htons(ETH_P_IP)) {
+		iph = (struct iphdr *)(pkt + g->l3off);
+		iph->tot_len = htons(*pktlen - g->l3off);
+		if (!g->fixedid)
+			iph->id = htons(g->id + i);
+		iph->check = 0;
+		iph->check = ip_fast_csum(iph, iph->ihl);
+	} else {
+		ip6h = (struct ipv6hdr *)(pkt + g->l3off);
+		ip6h->payload_len = htons(*pktlen - g->l3off - sizeof(*ip6h));
+	}
 
-        return sum;
+	th = (struct tcphdr *)(pkt + g->l4off);
+	th->seq = htonl(g->seq + off);
+	if (i > 0)
+		tcpflags &= ~TCPHDR_CWR;
+	if (i < g->segs - 1)
+		tcpflags &= ~(TCPHDR_FIN | TCPHDR_PSH);
+	tcp_flag_byte(th) = tcpflags;
+
+	return copylen;
 }
 
-static u_int16_t
-wrapsum(u_int32_t sum)
+static ssize_t write_segs_to_ring(struct pval_ring *r, struct sk_buff *skb,
+				  const struct pval_gso *g, char *hdr,
+				  u64 tstamp, struct pval_meta *m,
+				  bool reserved)
 {
-        sum = ~sum & 0xFFFF;
-        return (htons(sum));
+	struct pval_dev *pdev = r->pmdev->pdev;
+	ssize_t ret = 0;
+	u32 copylen, pktlen;
+	char *pkt;
+	u16 i;
+
+	m->segs = g->segs;
+	m->flags |= PVAL_META_F_SEG;
+
+	/* the 1st segment is built in place on hdr at head */
+	for (i = 0; i < g->segs; i++) {
+		if (i > 0 && reserved)
+			reserved = ring_reserve(r);
+		if (!reserved && !trace_pval_record_enabled())
+			break;
+		pkt = ring_pkt(r, r->head);
+		copylen = pval_gso_seg(g, skb, pkt, hdr, i, &pktlen);
+		if (pkt == hdr && i > 0)
+			copylen = min_t(u32, copylen, g->hdrlen);
+		copylen = min_t(u32, copylen, READ_ONCE(pdev->snaplen));
+		m->seg = i;
+		ring_trace_record(r, tstamp, copylen, pktlen, m, pkt);
+		if (!reserved)
+			continue;
+		ring_fill_record(r, tstamp, copylen, pktlen, m);
+		ring_write_next(r);
+		ret += copylen;
+	}
+	ring_wake_reader(r);
+
+	return ret;
 }
 
+/* put a PVAL_REC_GAP record with the num of records dropped at head */
+static inline void ring_write_gap(struct pval_ring *r)
+{
+	struct pval_meta m;
+	__le64 num = cpu_to_le64(r->drops);
+
+	memset(&m, 0, sizeof(m));
+	m.type = PVAL_REC_GAP;
+	m.dir = r->dir;
+	m.tssrc = r->pmdev->pdev->tssrc == PVAL_TSSRC_TSC ?
+		PVAL_TSSRC_TSC : PVAL_TSSRC_SW;
+	m.seq = r->drops;
+
+	memcpy(ring_pkt(r, r->head), &num, sizeof(num));
+	ring_fill_record(r, r->drop_ts, sizeof(num), 0, &m);
+	ring_write_next(r);
+	r->drops = 0;
+}
 
+static inline void ring_drop(struct pval_ring *r)
+{
+	if (!r->drops++)
+		r->drop_ts = pval_now(r->pmdev->pdev);
+}
 
-static int netdev_ioctl(struct net_device *dev, struct ifreq *ifr, int cmd)
+/* make a free slot at head for a record. Records that do not fit are
+ * counted, and the count is put in a gap record before the next record
+ * so that readers can tell lost records from silence.
+ */
+static inline bool ring_reserve(struct pval_ring *r)
 {
-	int rc;
-	mm_segment_t fs;
+	if (unlikely(r->drops) && !READ_ONCE(r->overwrite) &&
+	    ring_write_avail(r) < 2)
+		goto drop;	/* no room for the gap and the record */
 
-	if (!dev->netdev_ops->ndo_do_ioctl) {
-		pr_err("%s does not have ndo_do_ioctl\n", dev->name);
-		return -ENOTSUPP;
+	if (!__ring_reserve(r))
+		goto drop;
+
+	if (unlikely(r->drops)) {
+		ring_write_gap(r);
+		if (!__ring_reserve(r))
+			goto drop;
 	}
 
-	fs = get_fs();
-	set_fs(get_ds());
+	return true;
 
-	/* XXX: ioctl is called in user context, so that ioctl
-	 * implementations uses copy_from/to_user for ifr->data. So,
-	 * switch FS segment register.
-	 */
+drop:
+	ring_drop(r);
+	return false;
+}
 
-	rc = dev->netdev_ops->ndo_do_ioctl(dev, ifr, cmd);
+/* put the latest clock correlation sample of the member link of the
+ * next packet before it. meta.ifindex tells the link.
+ */
+static inline void ring_write_clock(struct pval_ring *r, struct pval_dev *pdev,
+				    int ifindex)
+{
+	struct pval_clock clk;
+	struct pval_meta m;
+	struct pval_link *pl;
+	unsigned int seq;
+	u32 gen;
+	int n;
 
-	set_fs(fs);
+	if (likely(!pdev->clkcorr))
+		return;
 
-	return rc;
-}
+	pval_for_each_link(pdev, pl) {
+		if (pl->dev->ifindex == ifindex)
+			break;
+	}
+	if (pl == pdev->links + pdev->num_links)
+		return;
+	n = pl - pdev->links;
 
+	if (likely(READ_ONCE(pl->clk_gen) == r->clk_gen[n]))
+		return;
 
-static int pval_save_tstamp_config(struct pval_dev *pdev)
-{
-	int rc;
-	struct hwtstamp_config config;
-	struct ifreq ifr;
+	if (!READ_ONCE(r->overwrite) && ring_write_avail(r) < 2)
+		return;	/* keep the slot for the packet */
 
-	/* save the current hwtstamp config to pdev->original */
-	memset(&ifr, 0, sizeof(ifr));
-	strncpy(ifr.ifr_name, pdev->link->name, IFNAMSIZ);
-	ifr.ifr_data = &config;
+	if (!ring_reserve(r))
+		return;
 
-	rc = netdev_ioctl(pdev->link, &ifr, SIOCGHWTSTAMP);
+	do {
+		seq = read_seqcount_begin(&pdev->clk_seq);
+		clk = pl->clk;
+		gen = pl->clk_gen;
+	} while (read_seqcount_retry(&pdev->clk_seq, seq));
+
+	memset(&m, 0, sizeof(m));
+	m.type = PVAL_REC_CLOCK;
+	m.dir = r->dir;
+	m.tssrc = PVAL_TSSRC_HW;
+	m.ifindex = ifindex;
+
+	memcpy(ring_pkt(r, r->head), &clk, sizeof(clk));
+	ring_trace_record(r, clk.phc, sizeof(clk), 0, &m, &clk);
+	ring_fill_record(r, clk.phc, sizeof(clk), 0, &m);
+	ring_write_next(r);
+	r->clk_gen[n] = gen;
+}
 
-	if (rc) {
-		pr_err("%s: %s failed to get hwtstamp config: %d\n",
-		       __func__, pdev->link->name, rc);
-		return rc;
-	}
+static void ring_write_burst(struct pval_mdev *pmdev, struct pval_bdet *b)
+{
+	struct pval_ring *r = pmdev_ring(pmdev);
+	struct pval_burst ev;
+	struct pval_meta m;
+
+	ev.start = b->start;
+	ev.end = b->last;
+	ev.bytes = b->bytes;
+	ev.pkts = b->pkts;
+	ev.hash = b->cand;
+	ev.window = pmdev->pdev->burstwin;
+	ev.windows = b->windows;
+
+	memset(&m, 0, sizeof(m));
+	m.type = PVAL_REC_BURST;
+	m.dir = r->dir;
+	m.tssrc = b->tssrc;
+	m.hash = ev.hash;
+
+	ring_trace_record(r, ev.start, sizeof(ev), 0, &m, &ev);
+
+	if (!pmdev->opened || !ring_reserve(r))
+		return;
 
-	pdev->original_config = config;
+	memcpy(ring_pkt(r, r->head), &ev, sizeof(ev));
+	ring_fill_record(r, ev.start, sizeof(ev), 0, &m);
+	ring_write_next(r);
+	ring_wake_reader(r);
+}
 
-	return 0;
+static void pval_burst_end(struct pval_mdev *pmdev, struct pval_bdet *b)
+{
+	ring_write_burst(pmdev, b);
+	b->start = 0;
+	b->bytes = 0;
+	b->pkts = 0;
+	b->windows = 0;
 }
 
-static int pval_restore_tstamp_config(struct pval_dev *pdev)
+/* period of checking an open burst for idle */
+static inline ktime_t pval_burst_idle(struct pval_dev *pdev)
 {
-	int rc = 0;
-	struct ifreq ifr;
+	return ns_to_ktime(max_t(u64, 2 * (u64)READ_ONCE(pdev->burstwin),
+				 PVAL_BURST_IDLE_MIN));
+}
 
-	/* set the hwtstamp config from pdev->original_config */
-	memset(&ifr, 0, sizeof(ifr));
-	strncpy(ifr.ifr_name, pdev->link->name, IFNAMSIZ);
-	ifr.ifr_data = &pdev->original_config;
+/* A burst followed by silence is reported here instead of waiting for
+ * the next packet. The timer is pinned to the CPU of the ring and runs
+ * in softirq, so it does not race with pval_burst_update().
+ */
+static enum hrtimer_restart pval_burst_timer(struct hrtimer *timer)
+{
+	struct pval_mdev *pmdev = container_of(timer, struct pval_mdev,
+					       burst_timer);
+	struct pval_dev *pdev = pmdev->pdev;
+	struct pval_bdet *b = &pmdev->bdet;
+
+	if (!b->start)
+		return HRTIMER_NORESTART;
+
+	if (b->pkts + b->win_pkts != b->seen) {
+		b->seen = b->pkts + b->win_pkts;
+		hrtimer_forward_now(timer, pval_burst_idle(pdev));
+		return HRTIMER_RESTART;
+	}
 
-	rc = netdev_ioctl(pdev->link, &ifr, SIOCSHWTSTAMP);
-	if (rc)
-		pr_err("%s: %s failed to set hwtstamp config: %d\n",
-		       __func__, pdev->link->name, rc);
+	/* no packets since the last check. Close the window too */
+	if (b->win_bytes >= pdev->burstbytes) {
+		b->bytes += b->win_bytes;
+		b->pkts += b->win_pkts;
+		b->windows++;
+	}
+	b->win_bytes = 0;
+	b->win_pkts = 0;
 
-	return rc;
-}
+	rcu_read_lock_bh();
+	pval_burst_end(pmdev, b);
+	rcu_read_unlock_bh();
 
+	return HRTIMER_NORESTART;
+}
 
-static int pval_set_tstamp_config(struct pval_dev *pdev)
+/* account skb to the microburst detector of pmdev. A burst ends at a
+ * window under burstbytes, at an idle window after it, or by
+ * pval_burst_timer() when no packets follow.
+ */
+static void pval_burst_update(struct pval_mdev *pmdev, struct sk_buff *skb)
 {
-	int rc = 0;
-	struct hwtstamp_config config;
-	struct ifreq ifr;
+	struct pval_dev *pdev = pmdev->pdev;
+	struct pval_bdet *b = &pmdev->bdet;
+	u64 win = pdev->burstwin;
+	u32 len = skb->len;
+	u32 hash;
+	s64 elapsed;
+	bool hot;
+	u64 now;
+	u8 tssrc;
+
+	now = pval_tstamp(pmdev_ring(pmdev), skb, &tssrc);
+	if (tssrc == PVAL_TSSRC_TSC) {
+		/* windows are in nsec, not in cycles */
+		now = ktime_get_real_ns();
+		tssrc = PVAL_TSSRC_SW;
+	}
 
-	/* set the hwtstamp config by pdev parameters */
-	config.flags = 0;
-	config.tx_type = 0;
-	config.rx_filter = 0;
+	/* timestamps of different sources may go backward a bit */
+	elapsed = now - b->win_start;
+	if (elapsed >= (s64)win) {
+		hot = b->win_bytes >= pdev->burstbytes;
+		if (hot) {
+			if (!b->start) {
+				b->start = b->win_start;
+				b->seen = 0;
+				hrtimer_start(&pmdev->burst_timer,
+					      pval_burst_idle(pdev),
+					      HRTIMER_MODE_REL_PINNED_SOFT);
+			}
+			b->bytes += b->win_bytes;
+			b->pkts += b->win_pkts;
+			b->windows++;
+		}
 
-	if (pdev->txtstamp)
-		config.tx_type = HWTSTAMP_TX_ON;
-	if (pdev->rxtstamp)
-		config.rx_filter = HWTSTAMP_FILTER_ALL;
+		if (b->start && (!hot || elapsed >= 2 * (s64)win))
+			pval_burst_end(pmdev, b);
 
-	memset(&ifr, 0, sizeof(ifr));
-	strncpy(ifr.ifr_name, pdev->link->name, IFNAMSIZ);
-	ifr.ifr_data = &config;
+		/* the top talker is voted in the window that starts a
+		 * burst and the rest of it, not in earlier traffic
+		 */
+		if (!b->start) {
+			b->cand = 0;
+			b->cand_bytes = 0;
+		}
 
-	rc = netdev_ioctl(pdev->link, &ifr, SIOCSHWTSTAMP);
-	if (rc)
-		pr_err("%s: %s failed to set hwtstamp config: %d\n",
-		       __func__, pdev->link->name, rc);
+		b->win_start = now;
+		b->win_bytes = 0;
+		b->win_pkts = 0;
+	}
 
-	return rc;
+	b->win_bytes += len;
+	b->win_pkts++;
+	b->last = now;
+	b->tssrc = tssrc;
+
+	hash = skb_get_hash(skb);
+	if (hash == b->cand) {
+		b->cand_bytes += len;
+	} else if (b->cand_bytes < len) {
+		b->cand = hash;
+		b->cand_bytes = len - b->cand_bytes;
+	} else
+		b->cand_bytes -= len;
 }
 
-
-/* Rx handler */
-rx_handler_result_t pdev_handle_frame(struct sk_buff **pskb)
+static inline ssize_t write_to_ring(struct pval_ring *r, struct sk_buff *skb)
 {
-	struct sk_buff *skb = *pskb;
-	struct pval_dev *pdev = rcu_dereference(skb->dev->rx_handler_data);
-	
-	skb = skb_share_check(skb, GFP_ATOMIC);
-	if (!skb)
-		return RX_HANDLER_CONSUMED;
+	struct pval_mdev *pmdev = r->pmdev;
+	u32 pktlen = skb->len - skb_mac_offset(skb);
+	u32 copylen = min_t(u32, pktlen, READ_ONCE(pmdev->pdev->snaplen));
+	struct pval_meta m;
+	struct pval_gso g;
+	bool reserved = false;
+	u64 tstamp;
+	u8 tssrc;
+	char *pkt;
+
+	if (READ_ONCE(pmdev->opened)) {
+		ring_write_clock(r, pmdev->pdev, pval_skb_ifindex(r, skb));
+		reserved = ring_reserve(r);
+	}
 
-	*pskb = skb;
-	skb->dev = pdev->dev;
-	skb->pkt_type = PACKET_HOST;
+	if (!reserved && !trace_pval_record_enabled())
+		return 0;
 
-	if (pdev->rxcopy && pdev_rx_pmdev(pdev)->opened)
-		write_to_ring(pdev_rx_ring(pdev), skb);
+	/* skb may be nonlinear (header split, GRO). Do not touch
+	 * beyond the linear area directly.
+	 */
+	pkt = ring_pkt(r, r->head);
+	if (skb_copy_bits(skb, skb_mac_offset(skb), pkt, copylen) < 0) {
+		/* the slot is left unused, but a reserve in overwrite
+		 * mode has dropped the oldest record already. Report
+		 * this one in the next gap record.
+		 */
+		if (reserved)
+			ring_drop(r);
+		return 0;
+	}
 
-	return RX_HANDLER_ANOTHER;
-}
+	pval_fill_meta(&m, r, skb, pkt, copylen);
+	tstamp = pval_tstamp(r, skb, &tssrc);
+	m.tssrc = tssrc;
 
+	if (skb_is_gso(skb)) {
+		if (pmdev->pdev->gro == PVAL_GRO_SEGS &&
+		    pval_gso_init(&g, skb, pkt, copylen, pktlen, &m))
+			return write_segs_to_ring(r, skb, &g, pkt, tstamp,
+						  &m, reserved);
 
-static int pval_init(struct net_device *dev)
-{
-	/* setup stats when this device is created */
-	dev->tstats = netdev_alloc_pcpu_stats(struct pcpu_sw_netstats);
-        if (!dev->tstats)
-                return -ENOMEM;
+		m.segs = skb_shinfo(skb)->gso_segs;
+		m.flags |= PVAL_META_F_GSO;
+	}
 
-        return 0;
+	ring_trace_record(r, tstamp, copylen, pktlen, &m, pkt);
+	if (!reserved)
+		return 0;
+
+	ring_fill_record(r, tstamp, copylen, pktlen, &m);
+	ring_write_next(r);
+	ring_wake_reader(r);
+
+	return copylen;
 }
 
-static void pval_uninit(struct net_device *dev)
+/* write_to_ring() from the txtstamp workers in process context */
+static void write_to_ring_bh(struct pval_mdev *pmdev, struct sk_buff *skb)
 {
-	free_percpu(dev->tstats);
+	rcu_read_lock_bh();
+	write_to_ring(pmdev_ring(pmdev), skb);
+	rcu_read_unlock_bh();
 }
-	
 
-static int pval_open(struct net_device *dev)
+static void pval_txtstamp_work(struct work_struct *work)
 {
-	int rc = 0;
-	struct pval_dev *pdev = netdev_priv(dev);
+	struct pval_mdev *pmdev = container_of(work, struct pval_mdev,
+					       txtstamp_work);
+	bool timeout = time_is_before_jiffies(pmdev->txtstamp_start +
+					      PVAL_TXTSTAMP_TIMEOUT);
 
-	if (netdev_is_rx_handler_busy(pdev->link)) {
-		pr_info("Rx Handler of %s is busy. Cannot open %s\n",
-		       pdev->link->name, pdev->dev->name);
-		rc = -EBUSY;
-		goto out;
-	} else {
-		pr_info("Register RX handler for %s\n", pdev->link->name);
-		netdev_rx_handler_register(pdev->link,  pdev_handle_frame,
-					   pdev);
-	}
+	if (unlikely(!pmdev->cloned_skb))
+		return;
 
-	/* XXX: save and configure hwtstamp 
-	 * This should handle erros (mainy, -ENOTSUPP).
-	 * However, it resitrct development environment because
-	 * emulated e1000 devices do not suport hwtstamping.
-	 * Therefore, we ignore tstamp config errors.
-	 */
-	pval_set_tstamp_config(pdev);
+	if (unlikely(READ_ONCE(pmdev->pdev->dying))) {
+		kfree_skb(pmdev->cloned_skb);
+		pmdev->cloned_skb = NULL;
+		return;
+	}
 
-	/* set link device all multi and promisc */
-	rc = dev_set_promiscuity(pdev->link, 1);
-	if (rc < 0)
-		goto err_out;
+	if (skb_hwtstamps(pmdev->cloned_skb)->hwtstamp != 0) {
+		if (pmdev->pdev->txcopy && pval_recording(pmdev))
+			write_to_ring_bh(pmdev, pmdev->cloned_skb);
+		kfree_skb(pmdev->cloned_skb);
+		pmdev->cloned_skb = NULL;
+		//spin_unlock(&pmdev->txtstamp_lock);		
+		return;
+	}
 
-	return rc;
+	if (timeout) {
+		pr_err("retrieving txtstamp timeout on %s\n", pmdev->name);
+		kfree_skb(pmdev->cloned_skb);
+		pmdev->cloned_skb = NULL;
+		//spin_unlock(&pmdev->txtstamp_lock);
 
-err_out:
-	pval_restore_tstamp_config(pdev);
-	netdev_rx_handler_unregister(pdev->link);
-out:
-	return rc;
+	} else {
+		/* reschedule to keep checking */
+		queue_work(pmdev->pdev->wq, &pmdev->txtstamp_work);
+	}
 }
 
-static int pval_stop(struct net_device *dev)
+static void pval_worker_free(struct pval_worker *worker)
 {
-	struct pval_dev *pdev = netdev_priv(dev);
-
-	netdev_rx_handler_unregister(pdev->link);
-	dev_set_promiscuity(pdev->link, -1);
+	struct pval_dev *pdev = worker->pmdev->pdev;
 
-	return 0;
+	kfree_skb(worker->skb);
+	kfree(worker);
+	atomic_dec(&pdev->txtstamp_inflight);
 }
 
-static netdev_tx_t pval_xmit(struct sk_buff *skb, struct net_device *dev)
+static void pval_txtstamp_work2(struct work_struct *work)
 {
-	int rc;
-	struct pval_dev *pdev = netdev_priv(dev);
-	struct pval_mdev *pmdev = pdev_tx_pmdev(pdev);
-	struct ethhdr *eth_old, *eth_new;
-	struct iphdr *iph_old, *iph_new;
-	struct ipopt_pval *ipp;
-	struct sk_buff *clone = NULL;
-	struct pval_worker *worker;
+	struct pval_worker *worker = container_of(work, struct pval_worker,
+						  work);
+	struct pval_mdev *pmdev = worker->pmdev;
+	bool timeout = time_is_before_jiffies(worker->start +
+					      PVAL_TXTSTAMP_TIMEOUT);
 
+	if (unlikely(READ_ONCE(pmdev->pdev->dying))) {
+		/* the device is going away. rings may be freed next */
+		pval_worker_free(worker);
+		return;
+	}
 
-	if (!(pdev->link->flags & IFF_UP))
-		return NETDEV_TX_BUSY;
+	if (skb_hwtstamps(worker->skb)->hwtstamp != 0) {
+		if (trace_txtstamp_done_enabled())
+			trace_txtstamp_done(pmdev->pdev->dev, pmdev->cpu,
+					    PVAL_SKB_CB(worker->skb)->seq,
+					    ktime_get_ns() - worker->start_ns,
+					    pval_mdev_avail(pmdev));
+		write_to_ring_bh(pmdev, worker->skb);
+		pval_worker_free(worker);
+		return;
+	}
 
-	if (!pdev->ipopt)
-		goto xmit;
+	if (timeout) {
+		if (trace_txtstamp_timeout_enabled())
+			trace_txtstamp_timeout(pmdev->pdev->dev, pmdev->cpu,
+					       PVAL_SKB_CB(worker->skb)->seq,
+					       ktime_get_ns() - worker->start_ns,
+					       pval_mdev_avail(pmdev));
+		/* no hwtstamp. record it with the software timestamp */
+		write_to_ring_bh(pmdev, worker->skb);
+		pval_worker_free(worker);
+	} else
+		queue_work(pmdev->pdev->wq, &worker->work);
+}
 
-	/* Advance eth+iph sizeof(struct ipopt_pval) bytes */
-	eth_old = (struct ethhdr *)skb_mac_header(skb);
-	iph_old = (struct iphdr *)skb_network_header(skb);
+/* queue a worker waiting for the TX hwtstamp of clone. false is
+ * returned when the clone should be recorded now with the software
+ * timestamp, because too many workers are in flight or the device is
+ * going away. Otherwise clone is consumed.
+ */
+static bool pval_txtstamp_queue(struct pval_mdev *pmdev,
+				struct sk_buff *clone)
+{
+	struct pval_dev *pdev = pmdev->pdev;
+	struct pval_worker *worker;
 
-	if (ntohs(eth_old->h_proto) != ETH_P_IP)
-		goto xmit;
+	if (unlikely(READ_ONCE(pdev->dying)))
+		return false;
 
-	__skb_push(skb, sizeof(struct ipopt_pval));
-	skb_reset_mac_header(skb);
-	skb_set_network_header(skb, sizeof(struct ethhdr));
+	if (atomic_inc_return(&pdev->txtstamp_inflight) >
+	    PVAL_TXTSTAMP_INFLIGHT) {
+		atomic_dec(&pdev->txtstamp_inflight);
+		return false;
+	}
 
-	eth_new = (struct ethhdr *)skb_mac_header(skb);
-	iph_new = (struct iphdr *)skb_network_header(skb);
-	
-	memmove(eth_new, eth_old, sizeof(struct ethhdr));
-	memmove(iph_new, iph_old, sizeof(struct iphdr));
+	worker = kmalloc(sizeof(struct pval_worker), GFP_ATOMIC);
+	if (!worker) {
+		pr_err("failed to allocate pval_worker\n");
+		atomic_dec(&pdev->txtstamp_inflight);
+		kfree_skb(clone);
+		return true;
+	}
+	INIT_WORK(&worker->work, pval_txtstamp_work2);
+	worker->skb = clone;
+	worker->pmdev = pmdev;
+	worker->start = jiffies;
+	worker->start_ns = ktime_get_ns();
+	queue_work(pdev->wq, &worker->work);
+
+	return true;
+}
 
-	/* Insert Pval IP Option and update iphlen and checksum */
-	ipp = (struct ipopt_pval *)(iph_new + 1);
-	ipp->type	= IPOPT_PVAL;
-	ipp->length	= sizeof(struct ipopt_pval);
-	ipp->reserved	= 0;
-	ipp->cpu	= smp_processor_id();
-	ipp->seq	= pdev->seq++;
+/* stop TX tstamp workers before the rings are freed. Workers that are
+ * already queued see dying and free their clones on the next run
+ * instead of waiting for PVAL_TXTSTAMP_TIMEOUT.
+ */
+static void pval_txtstamp_drain(struct pval_dev *pdev)
+{
+	int n;
+	struct pval_mdev *pmdev;
 
-	iph_new->ihl	+= sizeof(struct ipopt_pval) >> 2;
-	iph_new->tot_len	= htons(ntohs(iph_new->tot_len) +
-					sizeof(struct ipopt_pval));
-	iph_new->check	= 0;
-	iph_new->check	= wrapsum(checksum(iph_new,
-					   sizeof(struct iphdr) +
-					   sizeof(struct ipopt_pval),
-					   0));
+	WRITE_ONCE(pdev->dying, true);
+	synchronize_net();	/* no xmit queues workers after this */
 
-	skb_scrub_packet(skb, false);
-	skb_orphan(skb);
+	drain_workqueue(pdev->wq);
+	for (n = 0; n < pdev->num_cpus; n++) {
+		pmdev = &pdev->txmdevs[n];
+		cancel_work_sync(&pmdev->txtstamp_work);
+		kfree_skb(pmdev->cloned_skb);
+		pmdev->cloned_skb = NULL;
+	}
 
-xmit:
-	/* we need a clone of this skb because txtstamp_work and
-	 * txcopy run after dev_queue_xmit().
-	 * XXX: skb_get() can substitute skb_clone()?
-	 */
-	
-	if (pdev->txtstamp)
-		skb_shinfo(skb)->tx_flags |= SKBTX_HW_TSTAMP;
+	WARN_ON(atomic_read(&pdev->txtstamp_inflight));
+	destroy_workqueue(pdev->wq);
+	pdev->wq = NULL;
+}
 
-	if (pdev->txtstamp || pdev->txcopy) {
-		clone = skb_clone(skb, GFP_ATOMIC);
-		if (!clone) {
+static int pval_file_open(struct inode *inode, struct file *filp)
+{
+	int cpu, n;
+	char devname[IFNAMSIZ], direct[16], buf[PVAL_NAME_MAX];
+	struct net_device *dev;
+	struct pval_dev *pdev;
+	struct pval_mdev *pmdev;
+	struct pval_ring *old;
+
+	/* copy and change chardev to be capable of sscanf */
+	strncpy(buf, filp->f_path.dentry->d_name.name, PVAL_NAME_MAX);
+	for (n = 0; n < strlen(buf); n++) {
+		if (buf[n] == '-')
+			buf[n] = ' ';
+	}
+	if (sscanf(buf, "%s %s cpu %d", devname, direct, &cpu) < 1) {
+		pr_err("%s: failed to parse char dev %s\n",
+		       __func__, filp->f_path.dentry->d_name.name);
+		return -EINVAL;
+	}
+
+	dev = __dev_get_by_name(&init_net, devname); // Do not dev_hold()
+	if (!dev) {
+		pr_err("netdevice %s not found\n", devname);
+		return -ENODEV;
+	}
+
+	if (dev->netdev_ops != &pdev_netdev_ops) {
+		pr_err("%s is not pval interface\n", devname);
+		return -EINVAL;
+	}
+
+	pdev = netdev_priv(dev);
+
+	if (cpu < 0 || cpu >= pdev->num_cpus) {
+		pr_err("invalid cpu number %d of %s\n", cpu,
+			filp->f_path.dentry->d_name.name);
+		return -EINVAL;
+	}
+
+	if (strncmp(direct, "tx", 2) == 0)
+		pmdev = &pdev->txmdevs[cpu];
+	else if (strncmp(direct, "rx", 2) == 0)
+		pmdev = &pdev->rxmdevs[cpu];
+	else {
+		pr_err("invalid direction %s of %s\n", direct,
+		       filp->f_path.dentry->d_name.name);
+		return -EINVAL;
+	}
+
+	if (pmdev->opened) {
+		pr_err("this miscdevice %s is already opened\n",
+		       filp->f_path.dentry->d_name.name);
+		return -EBUSY;
+	}
+
+	mutex_lock(&pmdev->lock);
+	pmdev->opened = true;
+	ring_zero(pmdev_ring(pmdev));	// flush the ring
+	if (pmdev->old) {
+		old = pmdev->old;
+		WRITE_ONCE(pmdev->old, NULL);
+		pval_put_ring(old);
+	}
+	hrtimer_cancel(&pmdev->burst_timer);
+	memset(&pmdev->bdet, 0, sizeof(pmdev->bdet));
+	pmdev->delta.on = false;
+	filp->private_data = pmdev;
+	mutex_unlock(&pmdev->lock);
+
+	return 0;
+}
+
+static int
+pval_file_release(struct inode *inode, struct file *filp)
+{
+	struct pval_mdev *pmdev = (struct pval_mdev *)filp->private_data;
+	struct pval_ring *old;
+
+	mutex_lock(&pmdev->lock);
+	ring_zero(pmdev_ring(pmdev));	// flush the ring
+	if (pmdev->old) {
+		old = pmdev->old;
+		WRITE_ONCE(pmdev->old, NULL);
+		pval_put_ring(old);
+	}
+	pmdev->opened = false;
+	filp->private_data = NULL;
+	mutex_unlock(&pmdev->lock);
+	return 0;
+}
+
+static bool pval_file_busy_poll(struct pval_mdev *pmdev)
+{
+	u64 end = local_clock() + (u64)pmdev->pdev->busypoll * NSEC_PER_USEC;
+
+	/* spin on the ring before sleeping. A sleep and wakeup cost
+	 * several usecs, which latency sensitive readers cannot pay.
+	 */
+	while (!pval_mdev_avail(pmdev)) {
+		if (signal_pending(current) || need_resched())
+			return false;
+		if (local_clock() > end)
+			return false;
+		cpu_relax();
+	}
+
+	return true;
+}
+
+static int pval_file_wait(struct pval_mdev *pmdev, struct kiocb *iocb)
+{
+	long rc;
+
+	if (pval_mdev_avail(pmdev))
+		return 0;
+
+	if ((iocb->ki_filp->f_flags & O_NONBLOCK) ||
+	    (iocb->ki_flags & IOCB_NOWAIT))
+		return -EAGAIN;
+
+	if (pmdev->pdev->busypoll && pval_file_busy_poll(pmdev))
+		return 0;
+
+	/* sleep until the wakeup threshold is reached. When fewer
+	 * packets are queued, return them after PVAL_WAKEUP_TIMEOUT.
+	 */
+	do {
+		rc = wait_event_interruptible_timeout(pmdev->wait,
+			pval_mdev_avail(pmdev) >= pmdev->pdev->wakeup,
+			PVAL_WAKEUP_TIMEOUT);
+		if (rc < 0)
+			return rc;
+	} while (!pval_mdev_avail(pmdev));
+
+	return 0;
+}
+
+/* iovec and kvec segments are laid out by the reader, and each of
+ * them receives one pval_slot (the readv() bulk API). bvec and pipe
+ * segments (fixed buffers, splice) are just pages, so slots are packed
+ * back to back into them and the number of bytes is returned.
+ */
+static inline bool pval_iter_segmented(const struct iov_iter *iter)
+{
+	switch (iov_iter_type(iter)) {
+	case ITER_IOVEC:
+	case ITER_KVEC:
+		return true;
+	}
+	return false;
+}
+
+/* room for the next slot in iter: the length of the segment that
+ * receives it, or 0 if none.
+ */
+static inline size_t pval_slot_seglen(struct iov_iter *iter, bool segmented)
+{
+	if (segmented)
+		return iov_iter_single_seg_count(iter);
+
+	if (iov_iter_count(iter) < sizeof(struct pval_slot))
+		return 0;
+	return sizeof(struct pval_slot);
+}
+
+static inline int pval_copy_slot(const struct pval_slot *s, size_t seglen,
+				 struct iov_iter *iter)
+{
+	size_t copylen = min_t(size_t, seglen, sizeof(struct pval_slot));
+
+	if (copy_to_iter(s, copylen, iter) != copylen)
+		return -EFAULT;
+	iov_iter_advance(iter, seglen - copylen);
+	return 0;
+}
+
+static ssize_t pval_read_slots(struct pval_ring *r, struct iov_iter *iter,
+			       u32 avail)
+{
+	size_t seglen;
+	struct pval_slot bounce, *s;
+	bool segmented = pval_iter_segmented(iter);
+	bool overwrite = READ_ONCE(r->overwrite);
+	u32 i, n = 0, overrun;
+
+	/* report overwritten records first */
+	overrun = atomic_read(&r->overrun);
+	if (overrun) {
+		seglen = pval_slot_seglen(iter, segmented);
+		if (!seglen)
+			return 0;
+		overrun = atomic_xchg(&r->overrun, 0);
+		memset(&bounce, 0, offsetof(struct pval_slot, pkt));
+		bounce.meta.type = PVAL_REC_OVERRUN;
+		bounce.meta.dir = r->dir;
+		bounce.meta.seq = overrun;
+		if (pval_copy_slot(&bounce, seglen, iter) < 0) {
+			atomic_add(overrun, &r->overrun);
+			return -EFAULT;
+		}
+		n++;
+	}
+
+	for (i = 0; i < avail; i++) {
+		seglen = pval_slot_seglen(iter, segmented);
+		if (!seglen)
+			break;
+
+		if (overwrite) {
+			if (!ring_pop_slot(r, &bounce))
+				break;
+			s = &bounce;
+		} else
+			s = &r->slots[r->tail];
+
+		if (pval_copy_slot(s, seglen, iter) < 0) {
+			if (n == 0)
+				return -EFAULT;
+			break;
+		}
+		if (!overwrite)
+			ring_read_next(r);
+		n++;
+	}
+
+	return segmented ? n : n * sizeof(struct pval_slot);
+}
+
+/* Split layout: the first segment receives the array of pval_desc,
+ * and the second segment, if any, receives payloads. Readers that
+ * need only timestamps pass a single segment, and payloads are never
+ * touched.
+ */
+static ssize_t pval_read_descs(struct pval_ring *r, struct iov_iter *iter,
+			       u32 avail)
+{
+	struct iov_iter piter;
+	struct pval_desc d;
+	char bounce[PVAL_PKT_LEN];
+	size_t dlen, plen = 0, off = 0, padlen;
+	bool segmented = pval_iter_segmented(iter);
+	bool overwrite = READ_ONCE(r->overwrite);
+	const char *pkt;
+	u32 i, n = 0, overrun;
+
+	if (segmented) {
+		dlen = iov_iter_single_seg_count(iter);
+		if (iter->nr_segs > 1) {
+			piter = *iter;
+			iov_iter_advance(&piter, dlen);
+			plen = iov_iter_single_seg_count(&piter);
+		}
+	} else
+		dlen = iov_iter_count(iter);
+
+	if (dlen < sizeof(struct pval_desc))
+		return 0;
+
+	/* report overwritten records first */
+	overrun = atomic_xchg(&r->overrun, 0);
+	if (overrun) {
+		memset(&d, 0, sizeof(d));
+		d.flags = PVAL_REC_OVERRUN << PVAL_DESC_F_TYPE_SHIFT;
+		d.seq = overrun;
+		if (copy_to_iter(&d, sizeof(d), iter) != sizeof(d)) {
+			atomic_add(overrun, &r->overrun);
+			return -EFAULT;
+		}
+		n++;
+	}
+
+	avail = min_t(u32, avail, dlen / sizeof(struct pval_desc) - n);
+
+	for (i = 0; i < avail; i++) {
+		if (overwrite) {
+			/* a popped record cannot be put back */
+			if (plen && off + PVAL_PKT_LEN > plen)
+				break;
+			if (!ring_pop_desc(r, &d, bounce))
+				break;
+			pkt = bounce;
+		} else {
+			d = r->descs[r->tail];
+			pkt = r->payload + r->tail * PVAL_PKT_LEN;
+		}
+
+		/* descs of a mmap()ed ring are writable from user space */
+		d.caplen = min_t(u16, d.caplen, PVAL_PKT_LEN);
+
+		if (plen) {
+			if (off + d.caplen > plen)
+				break;
+			if (copy_to_iter(pkt, d.caplen, &piter) != d.caplen)
+				goto fault;
+			padlen = min_t(size_t, plen - off,
+				       ALIGN(d.caplen,
+					     PVAL_DESC_PAYLOAD_ALIGN)) - d.caplen;
+			iov_iter_advance(&piter, padlen);
+			d.off = off;
+			d.flags |= PVAL_DESC_F_PAYLOAD;
+			off += d.caplen + padlen;
+		}
+
+		if (copy_to_iter(&d, sizeof(d), iter) != sizeof(d))
+			goto fault;
+		if (!overwrite)
+			ring_read_next(r);
+		n++;
+	}
+
+out:
+	return segmented ? n : n * sizeof(struct pval_desc);
+
+fault:
+	if (n == 0)
+		return -EFAULT;
+	goto out;
+}
+
+static inline u8 *pval_put_varint(u8 *p, u64 v)
+{
+	while (v >= 0x80) {
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+static void pval_delta_sync(struct pval_delta *dl, u64 tstamp)
+{
+	u8 *p = dl->buf + dl->len;
+
+	*p++ = PVAL_DELTA_T_SYNC;
+	put_unaligned_le64(tstamp, p);
+	dl->len += 1 + sizeof(u64);
+
+	dl->base = tstamp;
+	dl->cnt = 0;
+	memset(dl->flows, 0, sizeof(dl->flows));
+}
+
+static void pval_delta_put(struct pval_delta *dl, u8 type, u64 tstamp,
+			   u32 pktlen, u32 hash, const void *pkt, u32 caplen)
+{
+	u8 *p = dl->buf + dl->len, id;
+	s64 delta;
+	u64 zz;
+
+	if (type != PVAL_REC_PKT) {
+		caplen = min_t(u32, caplen, PVAL_DELTA_PAYLOAD);
+		*p++ = type << PVAL_DELTA_T_SHIFT | PVAL_DELTA_T_REC;
+		put_unaligned_le64(tstamp, p);
+		p += sizeof(u64);
+		*p++ = caplen;
+		memcpy(p, pkt, caplen);
+		dl->len = p + caplen - dl->buf;
+		return;
+	}
+
+	delta = tstamp - dl->base;
+	zz = ((u64)delta << 1) ^ (u64)(delta >> 63);
+	if (++dl->cnt > PVAL_DELTA_SYNC || zz >> (64 - PVAL_DELTA_T_SHIFT)) {
+		pval_delta_sync(dl, tstamp);
+		p = dl->buf + dl->len;
+		dl->cnt = 1;
+		zz = 0;
+	}
+
+	id = hash % PVAL_DELTA_FLOWS;
+	if (dl->flows[id] == hash) {
+		p = pval_put_varint(p, zz << PVAL_DELTA_T_SHIFT |
+				    PVAL_DELTA_T_PKT);
+		p = pval_put_varint(p, pktlen);
+		*p++ = id;
+	} else {
+		p = pval_put_varint(p, zz << PVAL_DELTA_T_SHIFT |
+				    PVAL_DELTA_T_FLOW);
+		p = pval_put_varint(p, pktlen);
+		*p++ = id;
+		put_unaligned_le32(hash, p);
+		p += sizeof(u32);
+		dl->flows[id] = hash;
+	}
+
+	dl->base = tstamp;
+	dl->len = p - dl->buf;
+}
+
+/* copy the encoded records out, and then release the pend records of
+ * the ring that they came from. On a fault, they stay in the ring.
+ */
+static inline ssize_t pval_delta_flush(struct pval_ring *r,
+				       struct pval_delta *dl,
+				       struct iov_iter *iter, u32 *pend)
+{
+	size_t len = dl->len;
+
+	if (copy_to_iter(dl->buf, len, iter) != len)
+		return -EFAULT;
+	dl->len = 0;
+	for (; *pend > 0; (*pend)--)
+		ring_read_next(r);
+	return len;
+}
+
+/* Delta stream: records of either layout are encoded into the byte
+ * stream described in pval.h. Packet bytes are never copied out.
+ */
+static ssize_t pval_read_delta(struct pval_ring *r, struct iov_iter *iter,
+			       u32 avail)
+{
+	struct pval_delta *dl = &r->pmdev->delta;
+	bool overwrite = READ_ONCE(r->overwrite);
+	size_t count = iov_iter_count(iter), done = 0;
+	const struct pval_slot *s;
+	struct pval_desc d;
+	u32 i, idx, pend = 0, overrun;
+	ssize_t ret;
+	__le64 num;
+
+	if (count < PVAL_DELTA_REC_MAX * 2)
+		return 0;
+
+	/* the first packet record of each read() has a sync point */
+	dl->len = 0;
+	dl->cnt = PVAL_DELTA_SYNC;
+
+	overrun = atomic_xchg(&r->overrun, 0);
+	if (overrun) {
+		num = cpu_to_le64(overrun);
+		pval_delta_put(dl, PVAL_REC_OVERRUN, 0, 0, 0, &num,
+			       sizeof(num));
+	}
+
+	for (i = 0; i < avail; i++) {
+		if (done + dl->len + PVAL_DELTA_REC_MAX > count)
+			break;
+
+		if (r->layout == PVAL_LAYOUT_SPLIT) {
+			if (overwrite) {
+				if (!ring_pop_desc(r, &d, dl->bounce.pkt))
+					break;
+				pval_delta_put(dl, PVAL_DESC_TYPE(d.flags),
+					       d.tstamp, d.pktlen, d.hash,
+					       dl->bounce.pkt, d.caplen);
+			} else {
+				idx = (r->tail + pend) & r->mask;
+				d = r->descs[idx];
+				pval_delta_put(dl, PVAL_DESC_TYPE(d.flags),
+					       d.tstamp, d.pktlen, d.hash,
+					       r->payload + idx * PVAL_PKT_LEN,
+					       d.caplen);
+			}
+		} else {
+			if (overwrite) {
+				if (!ring_pop_slot(r, &dl->bounce))
+					break;
+				s = &dl->bounce;
+			} else
+				s = &r->slots[(r->tail + pend) & r->mask];
+			pval_delta_put(dl, s->meta.type, s->tstamp, s->pktlen,
+				       s->meta.hash, s->pkt, s->len);
+		}
+
+		/* popped records of overwrite mode are lost on a fault */
+		if (!overwrite)
+			pend++;
+
+		if (dl->len > PVAL_DELTA_BUF - PVAL_DELTA_REC_MAX) {
+			ret = pval_delta_flush(r, dl, iter, &pend);
+			if (ret < 0)
+				goto fault;
+			done += ret;
+			overrun = 0;
+		}
+	}
+
+	ret = pval_delta_flush(r, dl, iter, &pend);
+	if (ret < 0)
+		goto fault;
+
+	return done + ret;
+
+fault:
+	if (overrun)
+		atomic_add(overrun, &r->overrun);
+	return done ? done : -EFAULT;
+}
+
+/* the ring to be read: the swapped-out ring until it is drained,
+ * so that records are read in order across a ring swap.
+ */
+static struct pval_ring *pval_read_ring(struct pval_mdev *pmdev)
+{
+	struct pval_ring *r = pmdev_ring(pmdev), *old = pmdev->old;
+	bool moved;
+
+	if (old) {
+		/* a producer does not go back to the old ring once it
+		 * has put a record into the new one.
+		 */
+		moved = !ring_emtpy(r);
+		if (!ring_emtpy(old) || atomic_read(&old->overrun))
+			return old;
+		/* producers may be in the old ring until swapping ends */
+		if (READ_ONCE(pmdev->pdev->swapping))
+			return moved ? r : old;
+		WRITE_ONCE(pmdev->old, NULL);
+		pval_put_ring(old);
+	}
+
+	return r;
+}
+
+static ssize_t
+pval_file_read_iter(struct kiocb *iocb, struct iov_iter *iter)
+{
+	ssize_t ret;
+	struct file *filp = iocb->ki_filp;
+	struct pval_mdev *pmdev = (struct pval_mdev *)filp->private_data;
+	struct pval_ring *r;
+
+	ret = pval_file_wait(pmdev, iocb);
+	if (ret < 0)
+		return ret;
+
+	mutex_lock(&pmdev->lock);
+	r = pval_read_ring(pmdev);
+
+	if (READ_ONCE(r->mapped))
+		r->tail = ring_tail(r);
+
+	if (pmdev->delta.on)
+		ret = pval_read_delta(r, iter, ring_read_avail(r));
+	else if (r->layout == PVAL_LAYOUT_SPLIT)
+		ret = pval_read_descs(r, iter, ring_read_avail(r));
+	else
+		ret = pval_read_slots(r, iter, ring_read_avail(r));
+
+	mutex_unlock(&pmdev->lock);
+
+	return ret;
+}
+
+static unsigned int pval_file_poll(struct file *file, poll_table *wait)
+{
+	struct pval_mdev *pmdev = (struct pval_mdev *)file->private_data;
+
+	poll_wait(file, &pmdev->wait, wait);
+	if (pval_mdev_avail(pmdev))
+		return POLLIN | POLLRDNORM;
+
+	return 0;
+}
+
+static long pval_file_ioctl(struct file *filp, unsigned int cmd,
+			    unsigned long arg)
+{
+	struct pval_mdev *pmdev = (struct pval_mdev *)filp->private_data;
+	struct pval_ring *r;
+	long rc = 0;
+
+	mutex_lock(&pmdev->lock);
+	r = pmdev_ring(pmdev);
+
+	switch (cmd) {
+	case PVAL_IOC_OVERWRITE:
+		/* the producer cannot push tail of a mmap()ed ring */
+		if (arg && READ_ONCE(r->mapped)) {
+			rc = -EBUSY;
+			break;
+		}
+		WRITE_ONCE(r->overwrite, !!arg);
+		/* a producer that still sees overwrite mode may push
+		 * tail, while the next read advances tail with a plain
+		 * store. Wait for producers before a reader can run.
+		 */
+		if (!arg)
+			synchronize_net();
+		break;
+
+	case PVAL_IOC_FREEZE:
+		WRITE_ONCE(r->frozen, !!arg);
+		/* producers run in the RX handler and in xmit with BH
+		 * disabled. Wait for them so that nothing is written
+		 * to the ring after freezing.
+		 */
+		if (arg)
+			synchronize_net();
+		break;
+
+	case PVAL_IOC_DELTA:
+		pmdev->delta.on = !!arg;
+		break;
+
+	default:
+		rc = -ENOTTY;
+	}
+
+	mutex_unlock(&pmdev->lock);
+
+	return rc;
+}
+
+/* A hugepage-backed ring is mapped by a PMD when the mapping is
+ * aligned to PMD_SIZE (see thp_get_unmapped_area()), and by 4K pages
+ * otherwise.
+ */
+static vm_fault_t pval_vm_huge_fault(struct vm_fault *vmf,
+				     enum page_entry_size pe_size)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct pval_ring *r = vma->vm_private_data;
+	unsigned long addr = vmf->address & PMD_MASK;
+	unsigned long pfn = page_to_pfn(r->page);
+
+	if (pe_size != PE_SIZE_PMD)
+		return VM_FAULT_FALLBACK;
+
+	if (addr != vma->vm_start || addr + PMD_SIZE > vma->vm_end)
+		return VM_FAULT_FALLBACK;
+
+	return vmf_insert_pfn_pmd(vma, addr, vmf->pmd,
+				  __pfn_to_pfn_t(pfn, PFN_DEV),
+				  vmf->flags & FAULT_FLAG_WRITE);
+}
+
+static vm_fault_t pval_vm_fault(struct vm_fault *vmf)
+{
+	struct pval_ring *r = vmf->vma->vm_private_data;
+	unsigned long pfn = page_to_pfn(r->page);
+
+	if (vmf->pgoff >= (1 << PVAL_HPAGE_ORDER))
+		return VM_FAULT_SIGBUS;
+
+	return vmf_insert_pfn(vmf->vma, vmf->address, pfn + vmf->pgoff);
+}
+
+/* a VMA is split or copied on fork */
+static void pval_vm_open(struct vm_area_struct *vma)
+{
+	struct pval_ring *r = vma->vm_private_data;
+
+	refcount_inc(&r->ref);
+	spin_lock(&r->map_lock);
+	r->mmaps++;
+	spin_unlock(&r->map_lock);
+}
+
+static void pval_vm_close(struct vm_area_struct *vma)
+{
+	struct pval_ring *r = vma->vm_private_data;
+
+	spin_lock(&r->map_lock);
+	if (--r->mmaps == 0) {
+		/* read() takes over releasing records by r->tail */
+		r->tail = smp_load_acquire(&r->hdr->tail) & r->mask;
+		smp_store_release(&r->mapped, false);
+	}
+	spin_unlock(&r->map_lock);
+	pval_put_ring(r);
+}
+
+static const struct vm_operations_struct pval_vm_ops = {
+	.open		= pval_vm_open,
+	.close		= pval_vm_close,
+	.fault		= pval_vm_fault,
+	.huge_fault	= pval_vm_huge_fault,
+};
+
+static int pval_file_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct pval_mdev *pmdev = (struct pval_mdev *)filp->private_data;
+	struct pval_ring *r;
+	int rc = 0;
+
+	mutex_lock(&pmdev->lock);
+	r = pmdev_ring(pmdev);
+
+	if (!r->page) {
+		rc = -ENODEV;	/* not hugepage-backed */
+		goto out;
+	}
+
+	if (!(vma->vm_flags & VM_SHARED) || vma->vm_pgoff != 0 ||
+	    vma->vm_end - vma->vm_start > r->hdr->size) {
+		rc = -EINVAL;
+		goto out;
+	}
+
+	/* records in the swapped-out ring must be read() first, and
+	 * rings being swapped cannot be mapped.
+	 */
+	if (READ_ONCE(r->overwrite) || pmdev->old ||
+	    READ_ONCE(pmdev->pdev->swapping)) {
+		rc = -EBUSY;
+		goto out;
+	}
+
+	vma->vm_flags |= VM_PFNMAP | VM_HUGEPAGE | VM_DONTEXPAND |
+		VM_DONTDUMP;
+	vma->vm_ops = &pval_vm_ops;
+	vma->vm_private_data = r;
+
+	/* from now on, the reader releases records by hdr->tail */
+	refcount_inc(&r->ref);
+	spin_lock(&r->map_lock);
+	if (r->mmaps++ == 0) {
+		smp_store_release(&r->hdr->tail, r->tail);
+		WRITE_ONCE(r->mapped, true);
+	}
+	spin_unlock(&r->map_lock);
+
+out:
+	mutex_unlock(&pmdev->lock);
+	return rc;
+}
+
+static const struct file_operations pval_fops = {
+	.owner		= THIS_MODULE,
+	.open		= pval_file_open,
+	.release	= pval_file_release,
+	.read_iter	= pval_file_read_iter,
+	.poll		= pval_file_poll,
+	.unlocked_ioctl	= pval_file_ioctl,
+	.compat_ioctl	= pval_file_ioctl,
+	.mmap		= pval_file_mmap,
+	.get_unmapped_area = thp_get_unmapped_area,
+};
+
+
+/* bytes of a hugepage-backed ring of nslots, which must fit in a huge
+ * page.
+ */
+static size_t pval_ring_hugepage_size(u8 layout, u32 nslots)
+{
+	if (layout == PVAL_LAYOUT_SPLIT)
+		return PAGE_SIZE +
+			ALIGN(sizeof(struct pval_desc) * nslots, PAGE_SIZE) +
+			PVAL_PKT_LEN * nslots;
+	return PAGE_SIZE + sizeof(struct pval_slot) * nslots;
+}
+
+static inline bool pval_ringsize_valid(u32 nslots)
+{
+	return is_power_of_2(nslots) &&
+		nslots >= PVAL_RING_MIN && nslots <= PVAL_RING_MAX;
+}
+
+/* Allocate a huge page on the node of the cpu and lay out pval_mmap_hdr
+ * and the records in it.
+ */
+static int pval_init_ring_hugepage(struct pval_ring *ring, int cpu)
+{
+	struct pval_mmap_hdr *hdr;
+	size_t off = PAGE_SIZE;
+	char *mem;
+
+	BUILD_BUG_ON(PAGE_SIZE + sizeof(struct pval_slot) * PVAL_SLOT_NUM >
+		     PMD_SIZE);
+	BUILD_BUG_ON(PAGE_SIZE +
+		     ALIGN(sizeof(struct pval_desc) * PVAL_SLOT_NUM,
+			   PAGE_SIZE) +
+		     PVAL_PKT_LEN * PVAL_SLOT_NUM > PMD_SIZE);
+
+	if (pval_ring_hugepage_size(ring->layout, ring->mask + 1) > PMD_SIZE)
+		return -E2BIG;
+
+	ring->page = alloc_pages_node(cpu_to_node(cpu),
+				      GFP_KERNEL | __GFP_COMP | __GFP_ZERO |
+				      __GFP_NOWARN, PVAL_HPAGE_ORDER);
+	if (!ring->page) {
+		pr_err("failed to allocate a huge page for ring %d\n", cpu);
+		return -ENOMEM;
+	}
+
+	mem = page_address(ring->page);
+	hdr = (struct pval_mmap_hdr *)mem;
+	hdr->mask = ring->mask;
+	hdr->layout = ring->layout;
+	hdr->size = PMD_SIZE;
+
+	if (ring->layout == PVAL_LAYOUT_SPLIT) {
+		ring->descs = (struct pval_desc *)(mem + off);
+		hdr->descs_off = off;
+		off += ALIGN(sizeof(struct pval_desc) * (ring->mask + 1),
+			     PAGE_SIZE);
+		ring->payload = mem + off;
+		hdr->payload_off = off;
+	} else {
+		ring->slots = (struct pval_slot *)(mem + off);
+		hdr->slots_off = off;
+	}
+
+	ring->hdr = hdr;
+
+	return 0;
+}
+
+static int pval_init_ring(struct pval_ring *ring, int cpu, u8 dir, u8 layout,
+			  bool hugepage, u32 nslots)
+{
+	ring->cpu = cpu;
+	ring->dir = dir;
+	ring->head = 0;
+	ring->tail = 0;
+	ring->mask = nslots - 1;
+	ring->layout = layout;
+	ring->overwrite = false;
+	ring->frozen = false;
+	atomic_set(&ring->overrun, 0);
+	ring->drops = 0;
+	ring->drop_ts = 0;
+	ring->slots = NULL;
+	ring->descs = NULL;
+	ring->payload = NULL;
+	ring->page = NULL;
+	ring->hdr = NULL;
+	ring->mapped = false;
+	ring->mmaps = 0;
+	spin_lock_init(&ring->map_lock);
+	refcount_set(&ring->ref, 1);
+
+	if (hugepage)
+		return pval_init_ring_hugepage(ring, cpu);
+
+	if (layout == PVAL_LAYOUT_SPLIT) {
+		ring->descs = kvmalloc_array(nslots, sizeof(struct pval_desc),
+					     GFP_KERNEL);
+		ring->payload = kvmalloc_array(nslots, PVAL_PKT_LEN,
+					       GFP_KERNEL);
+		if (!ring->descs || !ring->payload) {
+			pr_err("failed to kmalloc pval_descs for ring %d\n",
+			       cpu);
+			goto err_out;
+		}
+		return 0;
+	}
+
+	ring->slots = kvmalloc_array(nslots, sizeof(struct pval_slot),
+				     GFP_KERNEL);
+	if (!ring->slots) {
+		pr_err("failed to kmalloc pval_slots for ring %d\n", cpu);
+		goto err_out;
+	}
+
+	return 0;
+
+err_out:
+	kvfree(ring->descs);
+	kvfree(ring->payload);
+	return -ENOMEM;
+}
+
+static struct pval_ring *pval_new_ring(struct pval_mdev *pmdev, u8 dir,
+				       u8 layout, bool hugepage, u32 nslots)
+{
+	struct pval_ring *ring;
+
+	ring = kzalloc_node(sizeof(*ring), GFP_KERNEL,
+			    cpu_to_node(pmdev->cpu));
+	if (!ring)
+		return NULL;
+
+	ring->pmdev = pmdev;
+	if (pval_init_ring(ring, pmdev->cpu, dir, layout, hugepage,
+			   nslots) < 0) {
+		kfree(ring);
+		return NULL;
+	}
+
+	return ring;
+}
+
+static int pval_init_miscdevice(struct pval_dev *pdev, struct pval_mdev *pmdev,
+				char *name, int cpu, u8 dir)
+{
+	struct pval_ring *ring;
+	int rc;
+
+	strncpy(pmdev->name, name, PVAL_NAME_MAX);
+	pmdev->pdev		= pdev;
+	pmdev->cpu		= cpu;
+	pmdev->opened		= false;
+	pmdev->cloned_skb	= NULL;
+	pmdev->old		= NULL;
+	pmdev->mdev.name	= pmdev->name;
+	pmdev->mdev.minor	= MISC_DYNAMIC_MINOR;
+	pmdev->mdev.fops	= &pval_fops;
+	init_waitqueue_head(&pmdev->wait);
+	hrtimer_init(&pmdev->burst_timer, CLOCK_MONOTONIC,
+		     HRTIMER_MODE_REL_PINNED_SOFT);
+	pmdev->burst_timer.function = pval_burst_timer;
+	mutex_init(&pmdev->lock);
+
+	ring = pval_new_ring(pmdev, dir, pdev->layout, pdev->hugepage,
+			     pdev->ringsize);
+	if (!ring) {
+		pr_err("failed to init ring on cpu %d for %s\n", cpu, name);
+		rc = -ENOMEM;
+		goto err_out;
+	}
+	RCU_INIT_POINTER(pmdev->ring, ring);
+
+	rc = misc_register(&pmdev->mdev);
+	if (rc < 0) {
+		pr_err("failed to register misc device %s\n", name);
+		goto err_misc_dev;
+	}
+
+	INIT_WORK(&pmdev->txtstamp_work, pval_txtstamp_work);
+	spin_lock_init(&pmdev->txtstamp_lock);
+
+	pr_info("%s is registered \n", pmdev->name);
+
+	return 0;
+
+err_misc_dev:
+	pval_destroy_ring(ring);
+	kfree(ring);
+
+err_out:
+	return rc;
+}
+
+
+static void pval_destroy_miscdevice(struct pval_mdev *pmdev)
+{
+	hrtimer_cancel(&pmdev->burst_timer);
+	misc_deregister(&pmdev->mdev);
+	pval_put_ring(rcu_dereference_protected(pmdev->ring, true));
+	if (pmdev->old)
+		pval_put_ring(pmdev->old);
+}
+
+
+
+/* misc from netmap pkt-gen */
+static uint16_t
+checksum(const void * data, uint16_t len, uint32_t sum)
+{
+        const uint8_t *addr = data;
+        uint32_t i;
+
+        /* Checksum all the pairs of bytes first... */
+        for (i = 0; i < (len & ~1U); i += 2) {
+                sum += (u_int16_t)ntohs(*((u_int16_t *)(addr + i)));
+                if (sum > 0xFFFF)
+                        sum -= 0xFFFF;
+        }
+        /*
+         * If there's a single byte left over, checksum it, too.
+         * Network byte order is big-endian, so the remaining byte is
+         * the high byte.
+         */
+
+        if (i < len) {
+                sum += addr[i] << 8;
+                if (sum > 0xFFFF)
+                        sum -= 0xFFFF;
+        }
+
+        return sum;
+}
+
+static u_int16_t
+wrapsum(u_int32_t sum)
+{
+        sum = ~sum & 0xFFFF;
+        return (htons(sum));
+}
+
+
+
+static int netdev_ioctl(struct net_device *dev, struct ifreq *ifr, int cmd)
+{
+	int rc;
+	mm_segment_t fs;
+
+	if (!dev->netdev_ops->ndo_do_ioctl) {
+		pr_err("%s does not have ndo_do_ioctl\n", dev->name);
+		return -ENOTSUPP;
+	}
+
+	fs = get_fs();
+	set_fs(get_ds());
+
+	/* XXX: ioctl is called in user context, so that ioctl
+	 * implementations uses copy_from/to_user for ifr->data. So,
+	 * switch FS segment register.
+	 */
+
+	rc = dev->netdev_ops->ndo_do_ioctl(dev, ifr, cmd);
+
+	set_fs(fs);
+
+	return rc;
+}
+
+
+static int pval_save_link_tstamp_config(struct pval_link *pl)
+{
+	int rc;
+	struct hwtstamp_config config;
+	struct ifreq ifr;
+
+	/* save the current hwtstamp config to pl->original_config */
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, pl->dev->name, IFNAMSIZ);
+	ifr.ifr_data = &config;
+
+	rc = netdev_ioctl(pl->dev, &ifr, SIOCGHWTSTAMP);
+
+	if (rc) {
+		pr_err("%s: %s failed to get hwtstamp config: %d\n",
+		       __func__, pl->dev->name, rc);
+		return rc;
+	}
+
+	pl->original_config = config;
+
+	return 0;
+}
+
+static int pval_restore_link_tstamp_config(struct pval_link *pl)
+{
+	int rc = 0;
+	struct ifreq ifr;
+
+	/* set the hwtstamp config from pl->original_config */
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, pl->dev->name, IFNAMSIZ);
+	ifr.ifr_data = &pl->original_config;
+
+	rc = netdev_ioctl(pl->dev, &ifr, SIOCSHWTSTAMP);
+	if (rc)
+		pr_err("%s: %s failed to set hwtstamp config: %d\n",
+		       __func__, pl->dev->name, rc);
+
+	return rc;
+}
+
+
+static int pval_set_link_tstamp_config(struct pval_dev *pdev,
+				       struct pval_link *pl)
+{
+	int rc = 0;
+	struct hwtstamp_config config;
+	struct ifreq ifr;
+
+	/* set the hwtstamp config by pdev parameters */
+	config.flags = 0;
+	config.tx_type = 0;
+	config.rx_filter = 0;
+
+	if (pdev->txtstamp)
+		config.tx_type = HWTSTAMP_TX_ON;
+	if (pdev->rxtstamp)
+		config.rx_filter = HWTSTAMP_FILTER_ALL;
+
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, pl->dev->name, IFNAMSIZ);
+	ifr.ifr_data = &config;
+
+	rc = netdev_ioctl(pl->dev, &ifr, SIOCSHWTSTAMP);
+	if (rc)
+		pr_err("%s: %s failed to set hwtstamp config: %d\n",
+		       __func__, pl->dev->name, rc);
+
+	return rc;
+}
+
+/* hwtstamp config of all lower links. A failure on a link does not
+ * stop the others, and the last error is returned.
+ */
+static int pval_save_tstamp_config(struct pval_dev *pdev)
+{
+	struct pval_link *pl;
+	int rc = 0, err;
+
+	pval_for_each_link(pdev, pl) {
+		err = pval_save_link_tstamp_config(pl);
+		if (err)
+			rc = err;
+	}
+
+	return rc;
+}
+
+static int pval_restore_tstamp_config(struct pval_dev *pdev)
+{
+	struct pval_link *pl;
+	int rc = 0, err;
+
+	pval_for_each_link(pdev, pl) {
+		err = pval_restore_link_tstamp_config(pl);
+		if (err)
+			rc = err;
+	}
+
+	return rc;
+}
+
+static int pval_set_tstamp_config(struct pval_dev *pdev)
+{
+	struct pval_link *pl;
+	int rc = 0, err;
+
+	pval_for_each_link(pdev, pl) {
+		err = pval_set_link_tstamp_config(pdev, pl);
+		if (err)
+			rc = err;
+	}
+
+	pdev->hwtstamp_ok = (rc == 0);
+
+	return rc;
+}
+
+
+/* clock correlation between PHC of lower link and system clocks */
+#define PVAL_PHC_SAMPLES	5
+
+static inline u64 ptp_clock_time_to_ns(const struct ptp_clock_time *t)
+{
+	return (u64)t->sec * NSEC_PER_SEC + t->nsec;
+}
+
+static int pval_phc_sample(struct pval_link *pl, struct pval_clock *clk)
+{
+	int n, rc;
+	u64 t1, t2, best = U64_MAX;
+	mm_segment_t fs;
+	struct ptp_sys_offset off;
+	struct system_time_snapshot snap;
+
+	memset(&off, 0, sizeof(off));
+	off.n_samples = PVAL_PHC_SAMPLES;
+
+	/* XXX: PTP_SYS_OFFSET takes a user pointer, so that switch
+	 * FS segment register as netdev_ioctl() does.
+	 */
+	fs = get_fs();
+	set_fs(get_ds());
+	rc = pl->phc->f_op->unlocked_ioctl(pl->phc, PTP_SYS_OFFSET,
+					   (unsigned long)&off);
+	set_fs(fs);
+	if (rc)
+		return rc;
+
+	ktime_get_snapshot(&snap);
+
+	/* ts[] is sys, phc, sys, phc, ... sys. Take the sample with
+	 * the shortest sys-sys window.
+	 */
+	for (n = 0; n < off.n_samples; n++) {
+		t1 = ptp_clock_time_to_ns(&off.ts[2 * n]);
+		t2 = ptp_clock_time_to_ns(&off.ts[2 * n + 2]);
+		if (t2 - t1 >= best)
+			continue;
+		best = t2 - t1;
+		clk->phc = ptp_clock_time_to_ns(&off.ts[2 * n + 1]);
+		clk->realtime = t1 + best / 2;
+	}
+
+	clk->monoraw = clk->realtime -
+		(ktime_to_ns(snap.real) - ktime_to_ns(snap.raw));
+	clk->phc_index = pl->phc_index;
+	clk->error = best / 2;
+
+	return 0;
+}
+
+static void pval_clk_work(struct work_struct *work)
+{
+	struct pval_dev *pdev = container_of(to_delayed_work(work),
+					     struct pval_dev, clk_work);
+	struct pval_clock clk;
+	struct pval_link *pl;
+	int rc;
+
+	pval_for_each_link(pdev, pl) {
+		if (!pl->phc)
+			continue;
+		rc = pval_phc_sample(pl, &clk);
+		if (rc == 0) {
+			write_seqcount_begin(&pdev->clk_seq);
+			pl->clk = clk;
+			pl->clk_gen++;
+			write_seqcount_end(&pdev->clk_seq);
+		} else
+			pr_err_ratelimited("%s: failed to read ptp%d: %d\n",
+					   pdev->dev->name, pl->phc_index, rc);
+	}
+
+	schedule_delayed_work(&pdev->clk_work,
+			      msecs_to_jiffies(pdev->clkcorr));
+}
+
+static int pval_clk_open(struct pval_dev *pdev, struct pval_link *pl)
+{
+	int rc;
+	char path[32];
+	struct file *phc;
+	struct ethtool_ts_info info;
+
+	memset(&info, 0, sizeof(info));
+	rc = __ethtool_get_ts_info(pl->dev, &info);
+	if (rc || info.phc_index < 0) {
+		netdev_warn(pdev->dev, "%s does not have PHC, "
+			    "clock records disabled\n", pl->dev->name);
+		return -ENODEV;
+	}
+
+	snprintf(path, sizeof(path), "/dev/ptp%d", info.phc_index);
+	phc = filp_open(path, O_RDONLY, 0);
+	if (IS_ERR(phc)) {
+		netdev_warn(pdev->dev, "failed to open %s\n", path);
+		return PTR_ERR(phc);
+	}
+	if (!phc->f_op->unlocked_ioctl) {
+		filp_close(phc, NULL);
+		return -ENOTSUPP;
+	}
+
+	pl->phc = phc;
+	pl->phc_index = info.phc_index;
+
+	return 0;
+}
+
+/* sample the PHC of each member link that has one */
+static int pval_clk_start(struct pval_dev *pdev)
+{
+	struct pval_link *pl;
+	int rc = -ENODEV;
+
+	if (!pdev->clkcorr)
+		return 0;
+
+	pval_for_each_link(pdev, pl) {
+		if (pval_clk_open(pdev, pl) == 0)
+			rc = 0;
+	}
+
+	if (rc == 0)
+		schedule_delayed_work(&pdev->clk_work, 0);
+
+	return rc;
+}
+
+static void pval_clk_stop(struct pval_dev *pdev)
+{
+	struct pval_link *pl;
+
+	cancel_delayed_work_sync(&pdev->clk_work);
+	pval_for_each_link(pdev, pl) {
+		if (!pl->phc)
+			continue;
+		filp_close(pl->phc, NULL);
+		pl->phc = NULL;
+		pl->phc_index = -1;
+	}
+}
+
+
+/* Remove the UDP shim from a received IPv4 packet to pdev->udpport
+ * after it is recorded, so that the socket gets the original payload.
+ * UDP checksum was cleared by the sender.
+ */
+static void pval_pull_udpshim(struct pval_dev *pdev, struct sk_buff *skb)
+{
+	const struct ipopt_pval *ipp;
+	struct iphdr *iph;
+	struct udphdr *uh;
+	unsigned int ihl, hdrlen, maclen;
+	u8 optlen;
+
+	if (skb->protocol != htons(ETH_P_IP) || skb_is_gso(skb) ||
+	    !pskb_may_pull(skb, sizeof(*iph)))
+		return;
+
+	iph = ip_hdr(skb);
+	if (iph->ihl < 5 || iph->protocol != IPPROTO_UDP ||
+	    ip_is_fragment(iph))
+		return;
+
+	ihl = iph->ihl << 2;
+	hdrlen = ihl + sizeof(*uh);
+	if (!pskb_may_pull(skb, hdrlen + IPOPT_PVAL_LEN_V0))
+		return;
+
+	uh = (struct udphdr *)(skb->data + ihl);
+	ipp = (const struct ipopt_pval *)(uh + 1);
+	if (ntohs(uh->dest) != pdev->udpport ||
+	    !pval_ipopt_valid(ipp, skb->len - hdrlen))
+		return;
+
+	optlen = ipp->length;
+	if (!pskb_may_pull(skb, hdrlen + optlen) || skb_cow_head(skb, 0))
+		return;
+
+	/* Move eth+iph+udph optlen bytes backward over the shim */
+	maclen = skb->data - skb_mac_header(skb);
+	memmove(skb_mac_header(skb) + optlen, skb_mac_header(skb),
+		maclen + hdrlen);
+	__skb_pull(skb, optlen);
+	skb->mac_header += optlen;
+	skb_reset_network_header(skb);
+	skb_set_transport_header(skb, ihl);
+
+	uh = udp_hdr(skb);
+	uh->len		= htons(ntohs(uh->len) - optlen);
+	uh->check	= 0;
+	skb->ip_summed	= CHECKSUM_NONE;
+
+	iph = ip_hdr(skb);
+	iph->tot_len	= htons(ntohs(iph->tot_len) - optlen);
+	iph->check	= 0;
+	iph->check	= wrapsum(checksum(iph, ihl, 0));
+}
+
+/* Rx handler */
+rx_handler_result_t pdev_handle_frame(struct sk_buff **pskb)
+{
+	struct sk_buff *skb = *pskb;
+	struct pval_dev *pdev = rcu_dereference(skb->dev->rx_handler_data);
+	
+	skb = skb_share_check(skb, GFP_ATOMIC);
+	if (!skb)
+		return RX_HANDLER_CONSUMED;
+
+	*pskb = skb;
+	skb->dev = pdev->dev;
+	if (pdev->promisc)
+		skb->pkt_type = PACKET_HOST;
+	else if (skb->pkt_type != PACKET_BROADCAST &&
+		 skb->pkt_type != PACKET_MULTICAST)
+		skb->pkt_type = ether_addr_equal(eth_hdr(skb)->h_dest,
+						 pdev->dev->dev_addr) ?
+			PACKET_HOST : PACKET_OTHERHOST;
+
+	if (pdev->rxcopy && pval_recording(pdev_rx_pmdev(pdev)))
+		write_to_ring(pdev_rx_ring(pdev), skb);
+
+	if (pdev->burstwin)
+		pval_burst_update(pdev_rx_pmdev(pdev), skb);
+
+	if (trace_rx_enabled())
+		trace_rx(pdev->dev, smp_processor_id(), skb->len,
+			 ring_read_avail(pdev_rx_ring(pdev)));
+
+	if (pdev->carrier == PVAL_CARRIER_UDP)
+		pval_pull_udpshim(pdev, skb);
+
+	return RX_HANDLER_ANOTHER;
+}
+
+/* packet handler on the lower link in passive mode. It receives shared
+ * skbs of both RXed and TXed (PACKET_OUTGOING) frames, and only copies
+ * them into the rings without touching the skbs.
+ */
+static int pval_tap_rcv(struct sk_buff *skb, struct net_device *dev,
+			struct packet_type *pt, struct net_device *orig_dev)
+{
+	struct pval_dev *pdev = pt->af_packet_priv;
+	struct pcpu_sw_netstats *stats = this_cpu_ptr(pdev->dev->tstats);
+	bool tx = skb->pkt_type == PACKET_OUTGOING;
+	struct pval_mdev *pmdev;
+
+	u64_stats_update_begin(&stats->syncp);
+	if (tx) {
+		stats->tx_packets++;
+		stats->tx_bytes += skb->len;
+	} else {
+		stats->rx_packets++;
+		stats->rx_bytes += skb->len;
+	}
+	u64_stats_update_end(&stats->syncp);
+
+	if (tx) {
+		pmdev = pdev_tx_pmdev(pdev);
+		if (pdev->txcopy && pval_recording(pmdev))
+			write_to_ring(pmdev_ring(pmdev), skb);
+	} else {
+		pmdev = pdev_rx_pmdev(pdev);
+		if (pdev->rxcopy && pval_recording(pmdev))
+			write_to_ring(pmdev_ring(pmdev), skb);
+		if (trace_rx_enabled())
+			trace_rx(pdev->dev, smp_processor_id(), skb->len,
+				 ring_read_avail(pmdev_ring(pmdev)));
+	}
+
+	if (pdev->burstwin)
+		pval_burst_update(pmdev, skb);
+
+	consume_skb(skb);
+	return NET_RX_SUCCESS;
+}
+
+
+static int pval_init(struct net_device *dev)
+{
+	struct pval_dev *pdev = netdev_priv(dev);
+
+	/* setup stats when this device is created */
+	dev->tstats = netdev_alloc_pcpu_stats(struct pcpu_sw_netstats);
+        if (!dev->tstats)
+                return -ENOMEM;
+
+	pdev->pcpu = alloc_percpu(struct pval_pcpu);
+	if (!pdev->pcpu) {
+		free_percpu(dev->tstats);
+		return -ENOMEM;
+	}
+
+        return 0;
+}
+
+static void pval_uninit(struct net_device *dev)
+{
+	int n;
+	struct pval_dev *pdev = netdev_priv(dev);
+
+	/* the device is closed and synchronize_net() is done before
+	 * ndo_uninit, so that xmit, the rx_handler, the tap and the pace
+	 * timer do not touch the rings anymore.
+	 */
+	if (pdev->wq)
+		pval_txtstamp_drain(pdev);
+	for (n = 0; n < pdev->num_cpus; n++) {
+		pval_destroy_miscdevice(&pdev->txmdevs[n]);
+		pval_destroy_miscdevice(&pdev->rxmdevs[n]);
+	}
+	pdev->num_cpus = 0;
+
+	free_percpu(pdev->pcpu);
+	free_percpu(dev->tstats);
+}
+
+
+/* lower qdisc honoring skb->tstamp (EDT), or pval paces by itself */
+static u8 pval_link_pace_mode(struct net_device *link)
+{
+	struct Qdisc *q = netdev_get_tx_queue(link, 0)->qdisc_sleeping;
+
+	/* fq paces by skb->tstamp (EDT) since 4.20, and etf is
+	 * introduced in 4.19. Older ones send stamped packets at once.
+	 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+	if (q && !strcmp(q->ops->id, "fq"))
+		return PVAL_PACE_FQ;
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 19, 0)
+	if (q && !strcmp(q->ops->id, "etf"))
+		return PVAL_PACE_ETF;
+#endif
+
+	return PVAL_PACE_TIMER;
+}
+
+/* EDT is used only when every lower link has the same qdisc for it */
+static u8 pval_pace_mode(struct pval_dev *pdev)
+{
+	struct pval_link *pl;
+	u8 mode = pval_link_pace_mode(pdev->link);
+
+	pval_for_each_link(pdev, pl) {
+		if (pval_link_pace_mode(pl->dev) != mode)
+			return PVAL_PACE_TIMER;
+	}
+
+	return mode;
+}
+
+/* receive frames to pval0 on the lower links: by their unicast
+ * filters, or by promiscuous mode when promisc is on.
+ */
+static int pval_filter_add(struct pval_dev *pdev, struct net_device *link)
+{
+	if (pdev->promisc)
+		return dev_set_promiscuity(link, 1);
+
+	return dev_uc_add(link, pdev->dev->dev_addr);
+}
+
+static void pval_filter_del(struct pval_dev *pdev, struct net_device *link)
+{
+	if (pdev->promisc)
+		dev_set_promiscuity(link, -1);
+	else
+		dev_uc_del(link, pdev->dev->dev_addr);
+}
+
+static int pval_filters_add(struct pval_dev *pdev)
+{
+	struct pval_link *pl;
+	int rc;
+
+	pval_for_each_link(pdev, pl) {
+		rc = pval_filter_add(pdev, pl->dev);
+		if (rc < 0)
+			goto err_out;
+	}
+
+	return 0;
+
+err_out:
+	while (pl-- > pdev->links)
+		pval_filter_del(pdev, pl->dev);
+	return rc;
+}
+
+static void pval_filters_del(struct pval_dev *pdev)
+{
+	struct pval_link *pl;
+
+	pval_for_each_link(pdev, pl)
+		pval_filter_del(pdev, pl->dev);
+}
+
+/* configure hwtstamp. Links without hwtstamp (emulated e1000, veth,
+ * virtio) are still usable: records fall back to software timestamps
+ * and are flagged so.
+ */
+static void pval_start_tstamp(struct pval_dev *pdev)
+{
+	if (pval_set_tstamp_config(pdev) &&
+	    pdev->tssrc == PVAL_TSSRC_HW &&
+	    (pdev->txtstamp || pdev->rxtstamp))
+		netdev_warn(pdev->dev, "lower links do not support hwtstamp, "
+			    "fall back to software timestamp\n");
+}
+
+/* passive mode leaves rx_handler, filters and xmit of the lower links
+ * as they are, and sees their frames through packet handlers.
+ */
+static int pval_open_passive(struct pval_dev *pdev)
+{
+	struct pval_link *pl;
+
+	pval_start_tstamp(pdev);
+
+	pval_for_each_link(pdev, pl) {
+		pr_info("Register packet handler for %s\n", pl->dev->name);
+		pl->tap.type = htons(ETH_P_ALL);
+		pl->tap.dev = pl->dev;
+		pl->tap.func = pval_tap_rcv;
+		pl->tap.af_packet_priv = pdev;
+		dev_add_pack(&pl->tap);
+	}
+
+	/* clock records are optional, failures are not fatal */
+	pval_clk_start(pdev);
+
+	return 0;
+}
+
+/* take frames of a lower link, and pass the flags of pval0 down */
+static int pval_link_open(struct pval_dev *pdev, struct pval_link *pl)
+{
+	struct net_device *dev = pdev->dev;
+	int rc;
+
+	rc = netdev_rx_handler_register(pl->dev, pdev_handle_frame, pdev);
+	if (rc < 0) {
+		pr_info("Rx Handler of %s is busy. Cannot open %s\n",
+			pl->dev->name, dev->name);
+		return rc;
+	}
+	pr_info("Register RX handler for %s\n", pl->dev->name);
+
+	if (dev->flags & IFF_ALLMULTI) {
+		rc = dev_set_allmulti(pl->dev, 1);
+		if (rc < 0)
+			goto err_handler;
+	}
+
+	if (dev->flags & IFF_PROMISC) {
+		rc = dev_set_promiscuity(pl->dev, 1);
+		if (rc < 0)
+			goto err_allmulti;
+	}
+
+	return 0;
+
+err_allmulti:
+	if (dev->flags & IFF_ALLMULTI)
+		dev_set_allmulti(pl->dev, -1);
+err_handler:
+	netdev_rx_handler_unregister(pl->dev);
+	return rc;
+}
+
+static void pval_link_stop(struct pval_dev *pdev, struct pval_link *pl)
+{
+	struct net_device *dev = pdev->dev;
+
+	netdev_rx_handler_unregister(pl->dev);
+
+	dev_uc_unsync(pl->dev, dev);
+	dev_mc_unsync(pl->dev, dev);
+	if (dev->flags & IFF_ALLMULTI)
+		dev_set_allmulti(pl->dev, -1);
+	if (dev->flags & IFF_PROMISC)
+		dev_set_promiscuity(pl->dev, -1);
+}
+
+static int pval_open(struct net_device *dev)
+{
+	int rc = 0;
+	struct pval_dev *pdev = netdev_priv(dev);
+	struct pval_link *pl;
+
+	if (pdev->passive)
+		return pval_open_passive(pdev);
+
+	pval_for_each_link(pdev, pl) {
+		rc = pval_link_open(pdev, pl);
+		if (rc < 0)
+			goto err_links;
+	}
+
+	pval_start_tstamp(pdev);
+
+	rc = pval_filters_add(pdev);
+	if (rc < 0)
+		goto err_out;
+
+	/* clock records are optional, failures are not fatal */
+	pval_clk_start(pdev);
+
+	/* XXX: qdisc changes on the lower link after this are not seen */
+	pdev->pace_mode = pval_pace_mode(pdev);
+
+	return rc;
+
+err_out:
+	pval_restore_tstamp_config(pdev);
+err_links:
+	while (pl-- > pdev->links)
+		pval_link_stop(pdev, pl);
+	return rc;
+}
+
+static int pval_stop(struct net_device *dev)
+{
+	struct pval_dev *pdev = netdev_priv(dev);
+	struct pval_link *pl;
+
+	pval_clk_stop(pdev);
+
+	if (pdev->passive) {
+		pval_for_each_link(pdev, pl)
+			dev_remove_pack(&pl->tap);
+		return 0;
+	}
+
+	hrtimer_cancel(&pdev->pace_timer);
+	skb_queue_purge(&pdev->pace_q);
+
+	pval_for_each_link(pdev, pl)
+		pval_link_stop(pdev, pl);
+	pval_filters_del(pdev);
+
+	return 0;
+}
+
+/* addresses and flags of pval0 are passed down to the lower links */
+static void pval_set_rx_mode(struct net_device *dev)
+{
+	struct pval_dev *pdev = netdev_priv(dev);
+	struct pval_link *pl;
+
+	if (pdev->passive)
+		return;
+
+	pval_for_each_link(pdev, pl) {
+		dev_uc_sync_multiple(pl->dev, dev);
+		dev_mc_sync_multiple(pl->dev, dev);
+	}
+}
+
+static void pval_change_rx_flags(struct net_device *dev, int change)
+{
+	struct pval_dev *pdev = netdev_priv(dev);
+	struct pval_link *pl;
+
+	if (!(dev->flags & IFF_UP) || pdev->passive)
+		return;
+
+	pval_for_each_link(pdev, pl) {
+		if (change & IFF_ALLMULTI)
+			dev_set_allmulti(pl->dev,
+					 dev->flags & IFF_ALLMULTI ? 1 : -1);
+		if (change & IFF_PROMISC)
+			dev_set_promiscuity(pl->dev,
+					    dev->flags & IFF_PROMISC ? 1 : -1);
+	}
+}
+
+static int pval_set_mac_address(struct net_device *dev, void *p)
+{
+	struct pval_dev *pdev = netdev_priv(dev);
+	struct sockaddr *addr = p;
+	struct pval_link *pl;
+	int rc;
+
+	if (!is_valid_ether_addr(addr->sa_data))
+		return -EADDRNOTAVAIL;
+
+	if (netif_running(dev) && !pdev->promisc && !pdev->passive) {
+		pval_for_each_link(pdev, pl) {
+			rc = dev_uc_add(pl->dev, addr->sa_data);
+			if (rc < 0)
+				goto err_out;
+		}
+		pval_for_each_link(pdev, pl)
+			dev_uc_del(pl->dev, dev->dev_addr);
+	}
+
+	ether_addr_copy(dev->dev_addr, addr->sa_data);
+
+	return 0;
+
+err_out:
+	while (pl-- > pdev->links)
+		dev_uc_del(pl->dev, addr->sa_data);
+	return rc;
+}
+
+static u64 pval_flow_seq(struct pval_pcpu *pc, u32 hash)
+{
+	struct pval_flow *set = pc->flows[hash & (PVAL_FLOW_SETS - 1)];
+	struct pval_flow *f, *victim = &set[0];
+	int n;
+
+	pc->tick++;
+
+	for (n = 0; n < PVAL_FLOW_WAYS; n++) {
+		f = &set[n];
+		if (f->last && f->hash == hash) {
+			f->last = pc->tick;
+			return f->seq++;
+		}
+		if (f->last < victim->last)
+			victim = f;
+	}
+
+	victim->hash = hash;
+	victim->seq = 0;
+	victim->last = pc->tick;
+
+	return victim->seq++;
+}
+
+static inline u8 pval_ipopt_len(const struct pval_dev *pdev)
+{
+	switch (pdev->ipoptts) {
+	case 32:
+		return IPOPT_PVAL_LEN_TS32;
+	case 64:
+		return IPOPT_PVAL_LEN_TS64;
+	}
+	return IPOPT_PVAL_LEN_V0;
+}
+
+/* Fill Pval IP Option of optlen bytes in skb. hash is the flow hash
+ * of the packet for flowseq.
+ */
+static void pval_fill_ipopt(struct pval_dev *pdev, struct sk_buff *skb,
+			    struct ipopt_pval *ipp, u8 optlen, u32 hash)
+{
+	struct ipopt_pval_v1 *ipp1;
+	struct pval_pcpu *pc;
+
+	ipp->type	= IPOPT_PVAL;
+	ipp->length	= optlen;
+	ipp->ver	= IPOPT_PVAL_MKVER(IPOPT_PVAL_V0);
+	ipp->cpu	= smp_processor_id();
+
+	pc = this_cpu_ptr(pdev->pcpu);
+	if (pdev->flowseq) {
+		ipp->ver	|= IPOPT_PVAL_F_FLOWSEQ;
+		ipp->seq	= pval_flow_seq(pc, hash);
+	} else
+		ipp->seq	= pc->seq++;
+
+	if (optlen > IPOPT_PVAL_LEN_V0) {
+		ipp1 = (struct ipopt_pval_v1 *)ipp;
+		ipp->ver = IPOPT_PVAL_MKVER(IPOPT_PVAL_V1) |
+			(ipp->ver & 0x0f);
+		if (optlen == IPOPT_PVAL_LEN_TS64)
+			ipp1->ts.ts64 = ktime_get_real_ns();
+		else
+			ipp1->ts.ts32 = (u32)ktime_get_real_ns();
+	}
+
+	PVAL_SKB_CB(skb)->seq = ipp->seq;
+	trace_ipopt_insert(pdev->dev, ipp->cpu, pdev->carrier, optlen,
+			   ipp->seq);
+}
+
+/* not skb_get_hash(): sk_txhash of a socket changes on rethink, and
+ * then the flow would restart its seq.
+ */
+static inline u32 pval_xmit_hash(struct pval_dev *pdev, struct sk_buff *skb)
+{
+	return pdev->flowseq ? __skb_get_hash_symmetric(skb) : 0;
+}
+
+/* Insert Pval IP Option after the IPv4 header */
+static bool pval_push_ipopt(struct pval_dev *pdev, struct sk_buff *skb)
+{
+	struct ethhdr *eth_old, *eth_new;
+	struct iphdr *iph_old, *iph_new;
+	u8 optlen = pval_ipopt_len(pdev);
+	u32 hash;
+
+	if (ntohs(eth_hdr(skb)->h_proto) != ETH_P_IP)
+		return false;
+
+	if (ip_hdr(skb)->ihl + (optlen >> 2) > 15)
+		return false;	/* no room in IP header */
+
+	if (skb_cow_head(skb, optlen))
+		return false;
+
+	hash = pval_xmit_hash(pdev, skb);
+
+	/* Advance eth+iph optlen bytes */
+	eth_old = (struct ethhdr *)skb_mac_header(skb);
+	iph_old = (struct iphdr *)skb_network_header(skb);
+
+	__skb_push(skb, optlen);
+	skb_reset_mac_header(skb);
+	skb_set_network_header(skb, sizeof(struct ethhdr));
+
+	eth_new = (struct ethhdr *)skb_mac_header(skb);
+	iph_new = (struct iphdr *)skb_network_header(skb);
+	
+	memmove(eth_new, eth_old, sizeof(struct ethhdr));
+	memmove(iph_new, iph_old, sizeof(struct iphdr));
+
+	/* Insert Pval IP Option and update iphlen and checksum */
+	pval_fill_ipopt(pdev, skb, (struct ipopt_pval *)(iph_new + 1), optlen,
+			hash);
+
+	iph_new->ihl	+= optlen >> 2;
+	iph_new->tot_len	= htons(ntohs(iph_new->tot_len) + optlen);
+	iph_new->check	= 0;
+	iph_new->check	= wrapsum(checksum(iph_new, iph_new->ihl << 2, 0));
+
+	return true;
+}
+
+/* Append Pval IP Option and pval_trailer at the end of the frame */
+static bool pval_put_trailer(struct pval_dev *pdev, struct sk_buff *skb)
+{
+	struct pval_trailer *t;
+	u8 optlen = pval_ipopt_len(pdev);
+	unsigned int pad = 0, len;
+	u32 hash;
+	char *tail;
+
+	/* a trailer of a GSO packet would be on the last segment only */
+	if (skb_is_gso(skb))
+		return false;
+
+	/* HW checksum would run over the trailer */
+	if (skb->ip_summed == CHECKSUM_PARTIAL && skb_checksum_help(skb))
+		return false;
+
+	if (skb_linearize(skb))
+		return false;
+
+	if (skb->len < ETH_ZLEN)
+		pad = ETH_ZLEN - skb->len;
+	len = pad + optlen + sizeof(*t);
+
+	if ((skb_cloned(skb) || skb_tailroom(skb) < len) &&
+	    pskb_expand_head(skb, 0, len, GFP_ATOMIC))
+		return false;
+
+	hash = pval_xmit_hash(pdev, skb);
+
+	tail = skb_put(skb, len);
+	memset(tail, 0, pad);
+	pval_fill_ipopt(pdev, skb, (struct ipopt_pval *)(tail + pad), optlen,
+			hash);
+
+	t = (struct pval_trailer *)(tail + pad + optlen);
+	t->length = optlen;
+	memset(t->reserved, 0, sizeof(t->reserved));
+	t->magic = htonl(PVAL_TRAILER_MAGIC);
+
+	return true;
+}
+
+/* Insert Pval IP Option after the UDP header of IPv4 packets to
+ * pdev->udpport. UDP checksum is cleared.
+ */
+static bool pval_push_udpshim(struct pval_dev *pdev, struct sk_buff *skb)
+{
+	struct iphdr *iph;
+	struct udphdr *uh;
+	u8 optlen = pval_ipopt_len(pdev);
+	unsigned int ihl, hdrlen;
+	char *old;
+	u32 hash;
+
+	if (ntohs(eth_hdr(skb)->h_proto) != ETH_P_IP || skb_is_gso(skb))
+		return false;
+
+	iph = ip_hdr(skb);
+	if (iph->protocol != IPPROTO_UDP || ip_is_fragment(iph))
+		return false;
+
+	ihl = iph->ihl << 2;
+	hdrlen = sizeof(struct ethhdr) + ihl + sizeof(struct udphdr);
+	if (!pskb_may_pull(skb, hdrlen))
+		return false;
+
+	uh = (struct udphdr *)(skb->data + sizeof(struct ethhdr) + ihl);
+	if (ntohs(uh->dest) != pdev->udpport)
+		return false;
+
+	if (skb->ip_summed == CHECKSUM_PARTIAL && skb_checksum_help(skb))
+		return false;
+
+	if (skb_cow_head(skb, optlen))
+		return false;
+
+	hash = pval_xmit_hash(pdev, skb);
+
+	/* Advance eth+iph+udph optlen bytes */
+	old = skb->data;
+	__skb_push(skb, optlen);
+	memmove(skb->data, old, hdrlen);
+	skb_reset_mac_header(skb);
+	skb_set_network_header(skb, sizeof(struct ethhdr));
+	skb_set_transport_header(skb, sizeof(struct ethhdr) + ihl);
+
+	pval_fill_ipopt(pdev, skb, (struct ipopt_pval *)(skb->data + hdrlen),
+			optlen, hash);
+
+	uh = udp_hdr(skb);
+	uh->len		= htons(ntohs(uh->len) + optlen);
+	uh->check	= 0;
+	skb->ip_summed	= CHECKSUM_NONE;
+
+	iph = ip_hdr(skb);
+	iph->tot_len	= htons(ntohs(iph->tot_len) + optlen);
+	iph->check	= 0;
+	iph->check	= wrapsum(checksum(iph, ihl, 0));
+
+	return true;
+}
+
+/* Insert Pval IP Option with the carrier of pdev */
+static void pval_push_pval(struct pval_dev *pdev, struct sk_buff *skb)
+{
+	bool pushed = false;
+
+	switch (pdev->carrier) {
+	case PVAL_CARRIER_IPOPT:
+		pushed = pval_push_ipopt(pdev, skb);
+		break;
+	case PVAL_CARRIER_TRAILER:
+		pushed = pval_put_trailer(pdev, skb);
+		break;
+	case PVAL_CARRIER_UDP:
+		pushed = pval_push_udpshim(pdev, skb);
+		break;
+	}
+
+	if (pushed) {
+		skb_scrub_packet(skb, false);
+		skb_orphan(skb);
+	}
+}
+
+/* lower link to xmit skb through. Flows are hashed across up members
+ * like bonding does, or NULL when none is up.
+ */
+static struct net_device *pval_xmit_link(struct pval_dev *pdev,
+					 struct sk_buff *skb)
+{
+	struct net_device *link;
+	int n, i;
+
+	if (pdev->num_links == 1)
+		return (pdev->link->flags & IFF_UP) ? pdev->link : NULL;
+
+	i = reciprocal_scale(skb_get_hash(skb), pdev->num_links);
+	for (n = 0; n < pdev->num_links; n++) {
+		link = pdev->links[(i + n) % pdev->num_links].dev;
+		if (netif_running(link) && netif_carrier_ok(link))
+			return link;
+	}
+
+	return NULL;
+}
+
+/* txqstate: the net_dev_queue tracepoint of dev_queue_xmit() gives the
+ * TX queue that the lower stack picked for skb, right before it is
+ * queued. pval_txq_req tells the probe which skb on this CPU is ours
+ * and where to put the state.
+ */
+struct pval_txq_req {
+	const struct sk_buff	*skb;
+	struct pval_skb_cb	*cb;
+};
+static DEFINE_PER_CPU(struct pval_txq_req, pval_txq_req);
+static struct tracepoint *pval_net_dev_queue;
+
+static void pval_txq_probe(void *data, struct sk_buff *skb)
+{
+	struct pval_txq_req *req = this_cpu_ptr(&pval_txq_req);
+	struct gnet_stats_queue qstats = { 0 };
+	struct pval_skb_cb *cb = req->cb;
+	struct netdev_queue *txq;
+	struct Qdisc *q;
+
+	if (req->skb != skb)
+		return;
+	req->skb = NULL;
+
+	txq = skb_get_tx_queue(skb->dev, skb);
+	cb->txq = skb_get_queue_mapping(skb);
+	cb->inflight = 0;
+#ifdef CONFIG_BQL
+	cb->inflight = txq->dql.num_queued - txq->dql.num_completed;
+#endif
+	q = rcu_dereference_bh(txq->qdisc);
+	if (q)
+		__gnet_stats_copy_queue(&qstats, q->cpu_qstats, &q->qstats,
+					q->q.qlen);
+	cb->backlog = qstats.backlog;
+	cb->txq_ok = true;
+}
+
+static void pval_find_net_dev_queue(struct tracepoint *tp, void *priv)
+{
+	if (!strcmp(tp->name, "net_dev_queue"))
+		pval_net_dev_queue = tp;
+}
+
+static void pval_txq_register(void)
+{
+	for_each_kernel_tracepoint(pval_find_net_dev_queue, NULL);
+	if (!pval_net_dev_queue ||
+	    tracepoint_probe_register(pval_net_dev_queue, pval_txq_probe,
+				      NULL)) {
+		pr_warn("net_dev_queue tracepoint is not available, "
+			"txqstate is not recorded\n");
+		pval_net_dev_queue = NULL;
+	}
+}
+
+static void pval_txq_unregister(void)
+{
+	if (!pval_net_dev_queue)
+		return;
+	tracepoint_probe_unregister(pval_net_dev_queue, pval_txq_probe, NULL);
+	tracepoint_synchronize_unregister();
+}
+
+/* Xmit skb through the lower link, and record it */
+static netdev_tx_t pval_xmit_lower(struct pval_dev *pdev, struct sk_buff *skb,
+				   struct net_device *link)
+{
+	int rc;
+	struct pval_mdev *pmdev = pdev_tx_pmdev(pdev);
+	struct pval_txq_req *req, prev;
+	struct sk_buff *clone = NULL;
+	unsigned int len;
+	u64 seq;
+
+	/* records tell the member link from skb->dev of the clone */
+	skb->dev = link;
+
+	/* we need a clone of this skb because txtstamp_work and
+	 * txcopy run after dev_queue_xmit().
+	 * XXX: skb_get() can substitute skb_clone()?
+	 */
+	
+	if (pdev->txtstamp && pval_use_hwtstamp(pdev))
+		skb_shinfo(skb)->tx_flags |= SKBTX_HW_TSTAMP;
+
+	/* software timestamp at xmit point, for the clone and the
+	 * microburst detector
+	 */
+	if (pdev->txtstamp || pdev->txcopy || pdev->burstwin)
+		PVAL_SKB_CB(skb)->tstamp = pval_now(pdev);
+
+	if (pdev->txtstamp || pdev->txcopy) {
+		clone = skb_clone(skb, GFP_ATOMIC);
+		if (!clone) {
 			//kfree_skb(skb);
 			pr_warn("clone failed\n");
 			return NETDEV_TX_BUSY;
 		}
+
+		PVAL_SKB_CB(clone)->txq_ok = false;
+	}
+
+	/* the probe fills the clone with the queue skb is put on */
+	req = this_cpu_ptr(&pval_txq_req);
+	prev = *req;
+	if (clone && pdev->txqstate) {
+		req->skb = skb;
+		req->cb = PVAL_SKB_CB(clone);
 	}
 
+	if (pdev->burstwin)
+		pval_burst_update(pmdev, skb);
+
 	/* Xmit this packet through lower link */
-	skb->dev = pdev->link;
+	len = skb->len;
+	seq = PVAL_SKB_CB(skb)->seq;
 	rc = dev_queue_xmit(skb);
+	*req = prev;
+
+	if (trace_xmit_enabled())
+		trace_xmit(pdev->dev, smp_processor_id(), len, rc, seq,
+			   ring_read_avail(pmdev_ring(pmdev)));
 
 	/* xmit done. obtain tstamp and copy the packet */
 	if (rc == NETDEV_TX_OK) {
@@ -750,99 +3611,443 @@ xmit:
 		 * pmdev->cloned_skb is always NULL.
 		 */
 
-		if (pdev->txtstamp) {
-			worker = kmalloc(sizeof(struct pval_worker),
-					 GFP_ATOMIC);
-			if (!worker) {
-				pr_err("failed to allocate pval_worker\n");
-				return rc;
-			}
-			INIT_WORK(&worker->work, pval_txtstamp_work2);
-			worker->skb = clone;
-			worker->ring = &pmdev->ring;
-			worker->start = jiffies;
-			schedule_work(&worker->work);
-
-		} else if (pdev->txcopy) {
-			/* not timestamping, copy only */
-			if (pmdev->opened)
-				write_to_ring(&pmdev->ring, clone);
+		if (pdev->txtstamp && pval_use_hwtstamp(pdev) &&
+		    pval_txtstamp_queue(pmdev, clone))
+			return rc;
+
+		if (clone) {
+			/* no hwtstamp to wait for, copy now */
+			if (pval_recording(pmdev))
+				write_to_ring(pmdev_ring(pmdev), clone);
 			kfree_skb(clone);
 		}
-	}
+	} else
+		kfree_skb(clone);
 
 	return rc;
 }
 
+static inline bool pval_paced(const struct pval_dev *pdev,
+			      const struct sk_buff *skb)
+{
+	if (!pdev->pacegap && !pdev->pacerate)
+		return false;
+
+	return !pdev->pacemark || skb->mark == pdev->pacemark;
+}
+
+/* departure time of a packet of len bytes, CLOCK_MONOTONIC nsec. The
+ * next departure is shared by all CPUs. pacerate counts the preamble,
+ * FCS and inter-frame gap (24 bytes) as wire bytes.
+ */
+static u64 pval_pace_next(struct pval_dev *pdev, unsigned int len)
+{
+	u64 now = ktime_get_ns();
+	u64 gap = pdev->pacegap;
+	s64 old, t;
+
+	if (pdev->pacerate)
+		gap = max_t(u64, gap, div64_u64((u64)(len + 24) * 8 *
+						NSEC_PER_SEC, pdev->pacerate));
+
+	do {
+		old = atomic64_read(&pdev->pace_next);
+		t = max_t(s64, old, now);
+	} while (atomic64_cmpxchg(&pdev->pace_next, old, t + gap) != old);
+
+	return t;
+}
+
+/* hold skb in pace_q until its departure time. pace_q is ordered by
+ * departure because the time is taken under the lock.
+ */
+static netdev_tx_t pval_pace_enqueue(struct pval_dev *pdev,
+				     struct sk_buff *skb)
+{
+	bool first;
+
+	spin_lock(&pdev->pace_q.lock);
+
+	if (skb_queue_len(&pdev->pace_q) >= pdev->dev->tx_queue_len) {
+		spin_unlock(&pdev->pace_q.lock);
+		atomic_long_inc(&pdev->dev->tx_dropped);
+		kfree_skb(skb);
+		return NETDEV_TX_OK;
+	}
+
+	PVAL_SKB_CB(skb)->sched = pval_pace_next(pdev, skb->len);
+	first = skb_queue_empty(&pdev->pace_q);
+	__skb_queue_tail(&pdev->pace_q, skb);
+	if (first)
+		hrtimer_start(&pdev->pace_timer,
+			      ns_to_ktime(PVAL_SKB_CB(skb)->sched),
+			      HRTIMER_MODE_ABS_SOFT);
+
+	spin_unlock(&pdev->pace_q.lock);
+
+	return NETDEV_TX_OK;
+}
+
+static enum hrtimer_restart pval_pace_timer(struct hrtimer *timer)
+{
+	struct pval_dev *pdev = container_of(timer, struct pval_dev,
+					     pace_timer);
+	struct net_device *link;
+	struct sk_buff *skb;
+	u64 sched;
+
+	spin_lock(&pdev->pace_q.lock);
+	while ((skb = skb_peek(&pdev->pace_q))) {
+		sched = PVAL_SKB_CB(skb)->sched;
+		if (sched > ktime_get_ns()) {
+			/* pval_pace_enqueue() may have started the timer
+			 * while the lock was dropped. Re-arm it under the
+			 * lock instead of restarting a queued timer.
+			 */
+			hrtimer_start(timer, ns_to_ktime(sched),
+				      HRTIMER_MODE_ABS_SOFT);
+			spin_unlock(&pdev->pace_q.lock);
+			return HRTIMER_NORESTART;
+		}
+		__skb_unlink(skb, &pdev->pace_q);
+		spin_unlock(&pdev->pace_q.lock);
+
+		link = pval_xmit_link(pdev, skb);
+		if (!link || pval_xmit_lower(pdev, skb, link) == NETDEV_TX_BUSY)
+			kfree_skb(skb);
+
+		spin_lock(&pdev->pace_q.lock);
+	}
+	spin_unlock(&pdev->pace_q.lock);
+
+	return HRTIMER_NORESTART;
+}
+
+static netdev_tx_t pval_xmit(struct sk_buff *skb, struct net_device *dev)
+{
+	struct pval_dev *pdev = netdev_priv(dev);
+	struct net_device *link;
+	u64 sched;
+
+	link = pval_xmit_link(pdev, skb);
+	if (!link)
+		return NETDEV_TX_BUSY;
+
+	/* pval0 is not a path to the lower link in passive mode */
+	if (pdev->passive) {
+		kfree_skb(skb);
+		return NETDEV_TX_OK;
+	}
+
+	PVAL_SKB_CB(skb)->seq = 0;
+	PVAL_SKB_CB(skb)->sched = 0;
+	if (pdev->ipopt)
+		pval_push_pval(pdev, skb);
+
+	if (pval_paced(pdev, skb)) {
+		if (pdev->pace_mode == PVAL_PACE_TIMER)
+			return pval_pace_enqueue(pdev, skb);
+
+		sched = pval_pace_next(pdev, skb->len);
+		PVAL_SKB_CB(skb)->sched = sched;
+		if (pdev->pace_mode == PVAL_PACE_ETF)
+			skb->tstamp = ktime_mono_to_any(ns_to_ktime(sched),
+							TK_OFFS_TAI);
+		else
+			skb->tstamp = ns_to_ktime(sched);
+	}
+
+	return pval_xmit_lower(pdev, skb, link);
+}
+
+
+static const struct net_device_ops pdev_netdev_ops = {
+	.ndo_init		= pval_init,
+	.ndo_uninit		= pval_uninit,
+	.ndo_open	       	= pval_open,
+	.ndo_stop		= pval_stop,
+	.ndo_start_xmit		= pval_xmit,
+	.ndo_get_stats64	= ip_tunnel_get_stats64,
+	.ndo_change_mtu		= eth_change_mtu,
+	.ndo_validate_addr	= eth_validate_addr,
+	.ndo_set_mac_address	= pval_set_mac_address,
+	.ndo_set_rx_mode	= pval_set_rx_mode,
+	.ndo_change_rx_flags	= pval_change_rx_flags,
+};
+
+
+static struct device_type pval_type = {
+	.name = "pval",
+};
+
+/* RTNL link operations */
+
+static const struct nla_policy pval_policy[IFLA_PVAL_MAX + 1] = {
+	[IFLA_PVAL_LINK]	= { .type = NLA_U32 },
+	[IFLA_PVAL_IPOPT]	= { .type = NLA_U8 },
+	[IFLA_PVAL_TXTSTAMP]	= { .type = NLA_U8 },
+	[IFLA_PVAL_RXTSTAMP]	= { .type = NLA_U8 },
+	[IFLA_PVAL_TXCOPY]	= { .type = NLA_U8 },
+	[IFLA_PVAL_RXCOPY]	= { .type = NLA_U8 },
+	[IFLA_PVAL_TXBUSYDROP]	= { .type = NLA_U8 },
+	[IFLA_PVAL_WAKEUP]	= { .type = NLA_U32 },
+	[IFLA_PVAL_BUSYPOLL]	= { .type = NLA_U32 },
+	[IFLA_PVAL_LAYOUT]	= { .type = NLA_U8 },
+	[IFLA_PVAL_GRO]		= { .type = NLA_U8 },
+	[IFLA_PVAL_TSSRC]	= { .type = NLA_U8 },
+	[IFLA_PVAL_CLKCORR]	= { .type = NLA_U32 },
+	[IFLA_PVAL_FLOWSEQ]	= { .type = NLA_U8 },
+	[IFLA_PVAL_IPOPTTS]	= { .type = NLA_U8 },
+	[IFLA_PVAL_CARRIER]	= { .type = NLA_U8 },
+	[IFLA_PVAL_UDPPORT]	= { .type = NLA_U16 },
+	[IFLA_PVAL_HUGEPAGE]	= { .type = NLA_U8 },
+	[IFLA_PVAL_XDPFD]	= { .type = NLA_S32 },
+	[IFLA_PVAL_XDP]		= { .type = NLA_U8 },
+	[IFLA_PVAL_PACEGAP]	= { .type = NLA_U32 },
+	[IFLA_PVAL_PACERATE]	= { .type = NLA_U64 },
+	[IFLA_PVAL_PACEMARK]	= { .type = NLA_U32 },
+	[IFLA_PVAL_PROMISC]	= { .type = NLA_U8 },
+	[IFLA_PVAL_PASSIVE]	= { .type = NLA_U8 },
+	[IFLA_PVAL_LINKS]	= { .type = NLA_BINARY,
+				    .len = sizeof(u32) * PVAL_MAX_LINKS },
+	[IFLA_PVAL_TXQSTATE]	= { .type = NLA_U8 },
+	[IFLA_PVAL_BURSTWIN]	= { .type = NLA_U32 },
+	[IFLA_PVAL_BURSTBYTES]	= { .type = NLA_U32 },
+	[IFLA_PVAL_RINGSIZE]	= { .type = NLA_U32 },
+	[IFLA_PVAL_SNAPLEN]	= { .type = NLA_U16 },
+};
+
+static void pval_setup(struct net_device *dev) {
+	/* initialize the device structure. */
+
+	struct pval_dev *pdev = netdev_priv(dev);
+
+	eth_hw_addr_random(dev);
+	ether_setup(dev);
+
+	dev->needs_free_netdev = true;
+	dev->netdev_ops = &pdev_netdev_ops;
+	SET_NETDEV_DEVTYPE(dev,  &pval_type);
+
+        dev->features   |= NETIF_F_LLTX;
+        //dev->features   |= NETIF_F_SG | NETIF_F_HW_CSUM;
+        //dev->features   |= NETIF_F_RXCSUM;
+        //dev->features   |= NETIF_F_GSO_SOFTWARE;
+
+	// dev->vlan_features = dev->features;
+        // dev->hw_features |= NETIF_F_SG | NETIF_F_HW_CSUM | NETIF_F_RXCSUM;
+        // dev->hw_features |= NETIF_F_GSO_SOFTWARE;
+        // netif_keep_dst(dev);
+        dev->priv_flags |= IFF_NO_QUEUE;
+	dev->priv_flags &= ~IFF_TX_SKB_SHARING;
+
+	/* MTU range: 68 - 65535 */
+        dev->min_mtu = ETH_MIN_MTU;
+        dev->max_mtu = ETH_MAX_MTU;
+
+	INIT_LIST_HEAD(&pdev->list);
+}
+
+/* Attach the XDP program of fd to the lower link, or detach it when fd
+ * is negative. The program is expected to put pval_xdp_meta in front of
+ * frames (see xdp/pval_xdp.c), and it stays attached until pval is
+ * deleted. Only drivers with native XDP (ndo_bpf) are supported.
+ */
+/* the lower link can take the program of fd, or release ours */
+static int pval_xdp_check(struct pval_dev *pdev, int fd,
+			  struct netlink_ext_ack *extack)
+{
+	const struct net_device_ops *ops = pdev->link->netdev_ops;
+	struct netdev_bpf xdp;
+	int rc;
+
+	if (fd < 0 && !pdev->xdp)
+		return 0;
+
+	/* RX timestamps at XDP are taken on pdev->link only */
+	if (fd >= 0 && pdev->num_links > 1) {
+		NL_SET_ERR_MSG(extack, "XDP needs a single lower link");
+		return -EOPNOTSUPP;
+	}
+
+	if (!ops->ndo_bpf) {
+		NL_SET_ERR_MSG(extack, "lower link does not support XDP");
+		return -EOPNOTSUPP;
+	}
+
+	/* do not replace a program that the operator attached */
+	if (fd >= 0 && !pdev->xdp) {
+		memset(&xdp, 0, sizeof(xdp));
+		xdp.command = XDP_QUERY_PROG;
+		rc = ops->ndo_bpf(pdev->link, &xdp);
+		if (rc < 0)
+			return rc;
+		if (xdp.prog_id || rcu_access_pointer(pdev->link->xdp_prog)) {
+			NL_SET_ERR_MSG(extack,
+				       "lower link already has an XDP program");
+			return -EBUSY;
+		}
+	}
+
+	return 0;
+}
+
+static int pval_xdp_attach(struct pval_dev *pdev, int fd,
+			   struct netlink_ext_ack *extack)
+{
+	const struct net_device_ops *ops = pdev->link->netdev_ops;
+	struct bpf_prog *prog = NULL;
+	struct netdev_bpf xdp;
+	int rc;
+
+	ASSERT_RTNL();
+
+	if (fd < 0 && !pdev->xdp)
+		return 0;
+
+	rc = pval_xdp_check(pdev, fd, extack);
+	if (rc < 0)
+		return rc;
+
+	if (fd >= 0) {
+		prog = bpf_prog_get_type_dev(fd, BPF_PROG_TYPE_XDP, false);
+		if (IS_ERR(prog)) {
+			NL_SET_ERR_MSG(extack, "invalid XDP program");
+			return PTR_ERR(prog);
+		}
+	}
+
+	memset(&xdp, 0, sizeof(xdp));
+	xdp.command = XDP_SETUP_PROG;
+	xdp.extack = extack;
+	xdp.prog = prog;
+
+	/* the driver takes the reference of prog, and releases the old */
+	rc = ops->ndo_bpf(pdev->link, &xdp);
+	if (rc < 0) {
+		if (prog)
+			bpf_prog_put(prog);
+		return rc;
+	}
+
+	pdev->xdp = prog ? true : false;
+	return 0;
+}
 
-static const struct net_device_ops pdev_netdev_ops = {
-	.ndo_init		= pval_init,
-	.ndo_uninit		= pval_uninit,
-	.ndo_open	       	= pval_open,
-	.ndo_stop		= pval_stop,
-	.ndo_start_xmit		= pval_xmit,
-	.ndo_get_stats64	= ip_tunnel_get_stats64,
-	.ndo_change_mtu		= eth_change_mtu,
-	.ndo_validate_addr	= eth_validate_addr,
-	.ndo_set_mac_address	= eth_mac_addr,
-};
+/* Check all attributes before anything is changed, so that an invalid
+ * request leaves both the rings and the configuration untouched.
+ */
+static int pval_nl_validate(struct pval_dev *pdev, struct nlattr *data[],
+			    struct netlink_ext_ack *extack)
+{
+	u32 win = pdev->burstwin, bytes = pdev->burstbytes;
+	u32 ringsize = pdev->ringsize;
+	bool hugepage = pdev->hugepage;
+	u8 layout = pdev->layout;
+
+	if (data && data[IFLA_PVAL_IPOPTTS]) {
+		switch (nla_get_u8(data[IFLA_PVAL_IPOPTTS])) {
+		case 0:
+		case 32:
+		case 64:
+			break;
+		default:
+			NL_SET_ERR_MSG(extack, "invalid ipoptts bits");
+			return -EINVAL;
+		}
+	}
 
+	if (data && data[IFLA_PVAL_CARRIER] &&
+	    nla_get_u8(data[IFLA_PVAL_CARRIER]) > PVAL_CARRIER_MAX) {
+		NL_SET_ERR_MSG(extack, "invalid carrier");
+		return -EINVAL;
+	}
 
-static struct device_type pval_type = {
-	.name = "pval",
-};
+	if (data && data[IFLA_PVAL_UDPPORT] &&
+	    nla_get_u16(data[IFLA_PVAL_UDPPORT]) == 0) {
+		NL_SET_ERR_MSG(extack, "invalid udp port");
+		return -EINVAL;
+	}
 
-/* RTNL link operations */
+	if (data && data[IFLA_PVAL_BURSTWIN])
+		win = nla_get_u32(data[IFLA_PVAL_BURSTWIN]);
+	if (data && data[IFLA_PVAL_BURSTBYTES])
+		bytes = nla_get_u32(data[IFLA_PVAL_BURSTBYTES]);
+	if (win && !bytes) {
+		NL_SET_ERR_MSG(extack, "burstwin needs burstbytes");
+		return -EINVAL;
+	}
 
-static const struct nla_policy pval_policy[IFLA_PVAL_MAX + 1] = {
-	[IFLA_PVAL_LINK]	= { .type = NLA_U32 },
-	[IFLA_PVAL_IPOPT]	= { .type = NLA_U8 },
-	[IFLA_PVAL_TXTSTAMP]	= { .type = NLA_U8 },
-	[IFLA_PVAL_RXTSTAMP]	= { .type = NLA_U8 },
-	[IFLA_PVAL_TXCOPY]	= { .type = NLA_U8 },
-	[IFLA_PVAL_RXCOPY]	= { .type = NLA_U8 },
-	[IFLA_PVAL_TXBUSYDROP]	= { .type = NLA_U8 },
-};
+	if (data && data[IFLA_PVAL_PASSIVE] && netif_running(pdev->dev)) {
+		NL_SET_ERR_MSG(extack, "cannot change passive while up");
+		return -EBUSY;
+	}
 
-static void pval_setup(struct net_device *dev) {
-	/* initialize the device structure. */
+	if (data && data[IFLA_PVAL_LAYOUT]) {
+		layout = nla_get_u8(data[IFLA_PVAL_LAYOUT]);
+		if (layout > PVAL_LAYOUT_MAX) {
+			NL_SET_ERR_MSG(extack, "invalid ring layout");
+			return -EINVAL;
+		}
+	}
 
-	struct pval_dev *pdev = netdev_priv(dev);
+	if (data && data[IFLA_PVAL_HUGEPAGE])
+		hugepage = !!nla_get_u8(data[IFLA_PVAL_HUGEPAGE]);
 
-	eth_hw_addr_random(dev);
-	ether_setup(dev);
+	if (data && data[IFLA_PVAL_RINGSIZE]) {
+		ringsize = nla_get_u32(data[IFLA_PVAL_RINGSIZE]);
+		if (!pval_ringsize_valid(ringsize)) {
+			NL_SET_ERR_MSG(extack, "invalid ring size");
+			return -EINVAL;
+		}
+	}
 
-	dev->needs_free_netdev = true;
-	dev->netdev_ops = &pdev_netdev_ops;
-	SET_NETDEV_DEVTYPE(dev,  &pval_type);
+	if (hugepage && pval_ring_hugepage_size(layout, ringsize) > PMD_SIZE) {
+		NL_SET_ERR_MSG(extack, "ring does not fit in a huge page");
+		return -EINVAL;
+	}
 
-        dev->features   |= NETIF_F_LLTX;
-        //dev->features   |= NETIF_F_SG | NETIF_F_HW_CSUM;
-        //dev->features   |= NETIF_F_RXCSUM;
-        //dev->features   |= NETIF_F_GSO_SOFTWARE;
+	if (data && data[IFLA_PVAL_GRO] &&
+	    nla_get_u8(data[IFLA_PVAL_GRO]) > PVAL_GRO_MAX) {
+		NL_SET_ERR_MSG(extack, "invalid gro mode");
+		return -EINVAL;
+	}
 
-	// dev->vlan_features = dev->features;
-        // dev->hw_features |= NETIF_F_SG | NETIF_F_HW_CSUM | NETIF_F_RXCSUM;
-        // dev->hw_features |= NETIF_F_GSO_SOFTWARE;
-        // netif_keep_dst(dev);
-        dev->priv_flags |= IFF_NO_QUEUE;
-	dev->priv_flags &= ~IFF_TX_SKB_SHARING;
+	if (data && data[IFLA_PVAL_TSSRC] &&
+	    nla_get_u8(data[IFLA_PVAL_TSSRC]) > PVAL_TSSRC_MAX) {
+		NL_SET_ERR_MSG(extack, "invalid timestamp source");
+		return -EINVAL;
+	}
 
-	/* MTU range: 68 - 65535 */
-        dev->min_mtu = ETH_MIN_MTU;
-        dev->max_mtu = ETH_MAX_MTU;
+	if (data && data[IFLA_PVAL_XDPFD])
+		return pval_xdp_check(pdev, nla_get_s32(data[IFLA_PVAL_XDPFD]),
+				      extack);
 
-	INIT_LIST_HEAD(&pdev->list);
+	return 0;
 }
 
 static int pval_nl_config(struct pval_dev *pdev,
 			  struct nlattr *tb[], struct nlattr *data[],
 			  struct netlink_ext_ack *extack)
 {
+	int rc;
+
 	/* XXX: 
 	 * Changing lower link is not supported.
 	 */
 
+	rc = pval_nl_validate(pdev, data, extack);
+	if (rc < 0)
+		return rc;
+
+	/* XDP may still fail in the driver, so that it goes first */
+	if (data && data[IFLA_PVAL_XDPFD]) {
+		rc = pval_xdp_attach(pdev, nla_get_s32(data[IFLA_PVAL_XDPFD]),
+				     extack);
+		if (rc < 0)
+			return rc;
+	}
+
 	/* parse and load configurations */
 	if (data && data[IFLA_PVAL_IPOPT]) {
 		if (nla_get_u8(data[IFLA_PVAL_IPOPT]))
@@ -886,6 +4091,160 @@ static int pval_nl_config(struct pval_dev *pdev,
 			pdev->txbusydrop = false;
 	}
 
+	if (data && data[IFLA_PVAL_FLOWSEQ]) {
+		if (nla_get_u8(data[IFLA_PVAL_FLOWSEQ]))
+			pdev->flowseq = true;
+		else
+			pdev->flowseq = false;
+	}
+
+	if (data && data[IFLA_PVAL_IPOPTTS])
+		pdev->ipoptts = nla_get_u8(data[IFLA_PVAL_IPOPTTS]);
+
+	if (data && data[IFLA_PVAL_CARRIER])
+		pdev->carrier = nla_get_u8(data[IFLA_PVAL_CARRIER]);
+
+	if (data && data[IFLA_PVAL_UDPPORT])
+		pdev->udpport = nla_get_u16(data[IFLA_PVAL_UDPPORT]);
+
+	if (data && data[IFLA_PVAL_PROMISC]) {
+		if (nla_get_u8(data[IFLA_PVAL_PROMISC]))
+			pdev->promisc = true;
+		else
+			pdev->promisc = false;
+	}
+
+	if (data && data[IFLA_PVAL_TXQSTATE]) {
+		if (nla_get_u8(data[IFLA_PVAL_TXQSTATE]))
+			pdev->txqstate = true;
+		else
+			pdev->txqstate = false;
+	}
+
+	if (data && data[IFLA_PVAL_BURSTWIN])
+		pdev->burstwin = nla_get_u32(data[IFLA_PVAL_BURSTWIN]);
+
+	if (data && data[IFLA_PVAL_BURSTBYTES])
+		pdev->burstbytes = nla_get_u32(data[IFLA_PVAL_BURSTBYTES]);
+
+	if (data && data[IFLA_PVAL_PASSIVE]) {
+		if (nla_get_u8(data[IFLA_PVAL_PASSIVE]))
+			pdev->passive = true;
+		else
+			pdev->passive = false;
+	}
+
+	if (data && data[IFLA_PVAL_WAKEUP]) {
+		pdev->wakeup = clamp_t(u32, nla_get_u32(data[IFLA_PVAL_WAKEUP]),
+				       1, PVAL_RING_MAX - 1);
+	}
+
+	if (data && data[IFLA_PVAL_BUSYPOLL])
+		pdev->busypoll = nla_get_u32(data[IFLA_PVAL_BUSYPOLL]);
+
+	if (data && data[IFLA_PVAL_LAYOUT])
+		pdev->layout = nla_get_u8(data[IFLA_PVAL_LAYOUT]);
+
+	if (data && data[IFLA_PVAL_HUGEPAGE]) {
+		if (nla_get_u8(data[IFLA_PVAL_HUGEPAGE]))
+			pdev->hugepage = true;
+		else
+			pdev->hugepage = false;
+	}
+
+	if (data && data[IFLA_PVAL_RINGSIZE])
+		pdev->ringsize = nla_get_u32(data[IFLA_PVAL_RINGSIZE]);
+
+	/* readers are woken up by the timeout on a smaller ring */
+	pdev->wakeup = min_t(u32, pdev->wakeup, pdev->ringsize - 1);
+
+	if (data && data[IFLA_PVAL_SNAPLEN]) {
+		pdev->snaplen = nla_get_u16(data[IFLA_PVAL_SNAPLEN]);
+		if (pdev->snaplen > PVAL_PKT_LEN)
+			pdev->snaplen = PVAL_PKT_LEN;
+	}
+
+	if (data && data[IFLA_PVAL_GRO])
+		pdev->gro = nla_get_u8(data[IFLA_PVAL_GRO]);
+
+	if (data && data[IFLA_PVAL_TSSRC])
+		pdev->tssrc = nla_get_u8(data[IFLA_PVAL_TSSRC]);
+
+	if (data && data[IFLA_PVAL_CLKCORR])
+		pdev->clkcorr = nla_get_u32(data[IFLA_PVAL_CLKCORR]);
+
+	if (data && data[IFLA_PVAL_PACEGAP])
+		pdev->pacegap = nla_get_u32(data[IFLA_PVAL_PACEGAP]);
+
+	if (data && data[IFLA_PVAL_PACERATE])
+		pdev->pacerate = nla_get_u64(data[IFLA_PVAL_PACERATE]);
+
+	if (data && data[IFLA_PVAL_PACEMARK])
+		pdev->pacemark = nla_get_u32(data[IFLA_PVAL_PACEMARK]);
+
+	return 0;
+}
+
+static void pval_put_links(struct pval_dev *pdev)
+{
+	struct pval_link *pl;
+
+	pval_for_each_link(pdev, pl)
+		dev_put(pl->dev);
+	pdev->num_links = 0;
+}
+
+/* IFLA_PVAL_LINKS lists ifindexes of all lower links (LAG members),
+ * or IFLA_PVAL_LINK is the only one. The first is pdev->link, which
+ * XDP and the link netns are taken from.
+ */
+static int pval_nl_links(struct pval_dev *pdev, struct net *net,
+			 struct nlattr *data[],
+			 struct netlink_ext_ack *extack)
+{
+	u32 ifindexes[PVAL_MAX_LINKS];
+	struct net_device *link;
+	int n, i, num = 0;
+
+	if (data && data[IFLA_PVAL_LINKS]) {
+		num = nla_len(data[IFLA_PVAL_LINKS]) / sizeof(u32);
+		if (num < 1 || num > PVAL_MAX_LINKS ||
+		    nla_len(data[IFLA_PVAL_LINKS]) % sizeof(u32)) {
+			NL_SET_ERR_MSG(extack, "invalid number of links");
+			return -EINVAL;
+		}
+		memcpy(ifindexes, nla_data(data[IFLA_PVAL_LINKS]),
+		       num * sizeof(u32));
+	} else if (data && data[IFLA_PVAL_LINK]) {
+		ifindexes[0] = nla_get_u32(data[IFLA_PVAL_LINK]);
+		num = 1;
+	}
+
+	if (!num) {
+		NL_SET_ERR_MSG(extack, "Invalid ifindex for underlay link");
+		return -ENODEV;
+	}
+
+	for (n = 0; n < num; n++) {
+		link = dev_get_by_index(net, ifindexes[n]);
+		for (i = 0; link && i < n; i++) {
+			if (pdev->links[i].dev == link) {
+				dev_put(link);
+				link = NULL;
+			}
+		}
+		if (!link) {
+			NL_SET_ERR_MSG(extack,
+				       "Invalid ifindex for underlay link");
+			pval_put_links(pdev);
+			return -ENODEV;
+		}
+		pdev->links[n].dev = link;
+		pdev->num_links = n + 1;
+	}
+
+	pdev->link = pdev->links[0].dev;
+
 	return 0;
 }
 
@@ -893,11 +4252,10 @@ static int pval_newlink(struct net *src_net, struct net_device *dev,
 			struct nlattr *tb[], struct nlattr *data[],
 			struct netlink_ext_ack *extack)
 {
-	int err, n;
+	int err, n, cpus;
 	char name[PVAL_NAME_MAX];
-	u32 ifindex;
-	unsigned short needed_headroom;
-	struct net_device *link = NULL;
+	unsigned short needed_headroom, needed_tailroom;
+	struct pval_link *pl;
 	struct pval_net *pnet = net_generic(src_net, pval_net_id);
 	struct pval_dev *pdev = netdev_priv(dev);
 
@@ -909,56 +4267,116 @@ static int pval_newlink(struct net *src_net, struct net_device *dev,
 	pdev->txcopy		= false;
 	pdev->rxcopy		= false;
 	pdev->txbusydrop	= true; /* default true */
-	memset(&pdev->original_config, 0, sizeof(struct hwtstamp_config));
-
-	/* check underlay link */
-	if (data && data[IFLA_PVAL_LINK]) {
-		ifindex = nla_get_u32(data[IFLA_PVAL_LINK]);
-		link = dev_get_by_index(src_net, ifindex);
-	}
-	if (!link) {
-		NL_SET_ERR_MSG(extack, "Invalid ifindex for underlay link");
-		return -ENODEV;
-	}
-	pdev->link = link;
+	pdev->flowseq		= false;
+	pdev->ipoptts		= 0;
+	pdev->carrier		= PVAL_CARRIER_IPOPT;
+	pdev->udpport		= PVAL_UDP_PORT_DEFAULT;
+	pdev->hugepage		= false;
+	pdev->promisc		= false;
+	pdev->passive		= false;
+	pdev->txqstate		= false;
+	pdev->burstwin		= 0;
+	pdev->burstbytes	= 0;
+	pdev->xdp		= false;
+	pdev->pacegap		= 0;
+	pdev->pacerate		= 0;
+	pdev->pacemark		= 0;
+	pdev->pace_mode		= PVAL_PACE_TIMER;
+	atomic64_set(&pdev->pace_next, 0);
+	skb_queue_head_init(&pdev->pace_q);
+	hrtimer_init(&pdev->pace_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_SOFT);
+	pdev->pace_timer.function = pval_pace_timer;
+	pdev->wakeup		= PVAL_WAKEUP_DEFAULT;
+	pdev->busypoll		= 0;
+	pdev->layout		= PVAL_LAYOUT_SLOT;
+	pdev->ringsize		= PVAL_SLOT_NUM;
+	pdev->snaplen		= PVAL_PKT_LEN;
+	pdev->gro		= PVAL_GRO_AGGR;
+	pdev->tssrc		= PVAL_TSSRC_HW;
+	pdev->hwtstamp_ok	= false;
+	pdev->wq		= NULL;
+	atomic_set(&pdev->txtstamp_inflight, 0);
+	pdev->dying		= false;
+	pdev->clkcorr		= 0;
+	seqcount_init(&pdev->clk_seq);
+	INIT_DELAYED_WORK(&pdev->clk_work, pval_clk_work);
+	memset(pdev->links, 0, sizeof(pdev->links));
+	pdev->num_links		= 0;
+
+	/* check underlay links */
+	err = pval_nl_links(pdev, src_net, data, extack);
+	if (err < 0)
+		return err;
 
 	/* parse and configure device */
-	pval_nl_config(pdev, tb, data, extack);
+	err = pval_nl_config(pdev, tb, data, extack);
+	if (err < 0) {
+		pval_put_links(pdev);
+		return err;
+	}
 
 	/* headroom allocate */
-	needed_headroom = sizeof(struct ipopt_pval);
-	needed_headroom += link->needed_headroom;
-	dev->needed_headroom = needed_headroom;
+	needed_headroom = 0;
+	needed_tailroom = 0;
+	pval_for_each_link(pdev, pl) {
+		needed_headroom = max(needed_headroom,
+				      pl->dev->needed_headroom);
+		needed_tailroom = max(needed_tailroom,
+				      pl->dev->needed_tailroom);
+	}
+	dev->needed_headroom = IPOPT_PVAL_LEN_TS64 + needed_headroom;
+	dev->needed_tailroom = (ETH_ZLEN + IPOPT_PVAL_LEN_TS64 +
+				sizeof(struct pval_trailer) +
+				needed_tailroom);
 
 	/* register ethernet device */
 	err = register_netdevice(dev);
 	if (err) {
 		netdev_err(dev, "failed to register netdevice %s\n",
 			   pdev->dev->name);
+		pval_xdp_attach(pdev, -1, NULL);
+		pval_put_links(pdev);
 		return err;
 	}
 
-	err = netdev_upper_dev_link(link, dev, extack);
-	if (err)
+	pval_for_each_link(pdev, pl) {
+		err = netdev_upper_dev_link(pl->dev, dev, extack);
+		if (err) {
+			while (pl-- > pdev->links)
+				netdev_upper_dev_unlink(pl->dev, dev);
+			goto unregister_netdev;
+		}
+	}
+
+	pdev->wq = alloc_workqueue("pval-%s", 0, 0, pdev->dev->name);
+	if (!pdev->wq) {
+		err = -ENOMEM;
 		goto unregister_netdev;
+	}
 
-	/* register misc device */
-	pdev->num_cpus = PVAL_MAX_CPUS > num_possible_cpus() ?
+	/* register misc device. num_cpus counts registered pairs, which
+	 * pval_uninit() destroys on errors.
+	 */
+	cpus = PVAL_MAX_CPUS > num_possible_cpus() ?
 		num_possible_cpus() : PVAL_MAX_CPUS;
 
-	for (n = 0; n < pdev->num_cpus; n++) {
-		/* XXX: should handle errors (free succseed mdevs )*/
+	for (n = 0; n < cpus; n++) {
 		snprintf(name, sizeof(name),
 			 "pval/%s-tx-cpu-%d", pdev->dev->name, n);
-		err = pval_init_miscdevice(pdev, &pdev->txmdevs[n], name, n);
+		err = pval_init_miscdevice(pdev, &pdev->txmdevs[n], name, n,
+					   PVAL_DIR_TX);
 		if (err < 0)
 			goto unregister_netdev;
 
 		snprintf(name, sizeof(name),
 			 "pval/%s-rx-cpu-%d", pdev->dev->name, n);
-		err = pval_init_miscdevice(pdev, &pdev->rxmdevs[n], name, n);
-		if (err < 0)
+		err = pval_init_miscdevice(pdev, &pdev->rxmdevs[n], name, n,
+					   PVAL_DIR_RX);
+		if (err < 0) {
+			pval_destroy_miscdevice(&pdev->txmdevs[n]);
 			goto unregister_netdev;
+		}
+		pdev->num_cpus = n + 1;
 	}
 
 	/* save current hwtstamp config of lower link */
@@ -970,60 +4388,286 @@ static int pval_newlink(struct net *src_net, struct net_device *dev,
 	return 0;
 
 unregister_netdev:
-	unregister_netdevice(dev);
+	pval_xdp_attach(pdev, -1, NULL);
+	pval_for_each_link(pdev, pl) {
+		if (netdev_has_upper_dev(pl->dev, dev))
+			netdev_upper_dev_unlink(pl->dev, dev);
+	}
+	unregister_netdevice(dev);	/* pval_uninit() frees wq and rings */
+	pval_put_links(pdev);
 	return err;
 }
 
+/* free the new rings of a failed change, and allow mmap() again */
+static void pval_abort_rings(struct pval_dev *pdev,
+			     struct pval_ring *rings[][PVAL_MAX_CPUS])
+{
+	int i, n;
+
+	for (i = 0; i < 2; i++) {
+		for (n = 0; n < pdev->num_cpus; n++) {
+			if (!rings[i][n])
+				continue;
+			pval_destroy_ring(rings[i][n]);
+			kfree(rings[i][n]);
+			rings[i][n] = NULL;
+		}
+	}
+	WRITE_ONCE(pdev->swapping, false);
+}
+
+/* Swap the rings for new ones of layout, hugepage and nslots while
+ * capturing. pval_prepare_rings() allocates the new rings, so that a
+ * failure leaves all rings unchanged, and pval_swap_rings() cannot
+ * fail. An mmap()ed ring cannot be swapped, so that the whole swap
+ * fails if any ring is mapped, and swapping blocks mmap() from
+ * prepare to swap or abort.
+ */
+static int pval_prepare_rings(struct pval_dev *pdev, u8 layout,
+			      bool hugepage, u32 nslots,
+			      struct pval_ring *rings[][PVAL_MAX_CPUS],
+			      struct netlink_ext_ack *extack)
+{
+	int i, n, rc = 0;
+	struct pval_mdev *pmdevs[] = { pdev->txmdevs, pdev->rxmdevs };
+	struct pval_mdev *pmdev;
+	struct pval_ring *old;
+
+	WRITE_ONCE(pdev->swapping, true);
+
+	for (i = 0; i < ARRAY_SIZE(pmdevs); i++) {
+		for (n = 0; n < pdev->num_cpus; n++) {
+			pmdev = &pmdevs[i][n];
+			mutex_lock(&pmdev->lock);
+			old = pmdev_ring(pmdev);
+			if (READ_ONCE(old->mapped)) {
+				NL_SET_ERR_MSG(extack,
+					       "pval chardev is mmap()ed");
+				rc = -EBUSY;
+			} else if (pmdev->old) {
+				NL_SET_ERR_MSG(extack,
+					       "old rings are not drained yet");
+				rc = -EBUSY;
+			}
+			mutex_unlock(&pmdev->lock);
+			if (rc < 0)
+				goto err_out;
+
+			if (old->layout == layout && !!old->page == hugepage &&
+			    old->mask == nslots - 1)
+				continue;
+
+			rings[i][n] = pval_new_ring(pmdev, old->dir, layout,
+						    hugepage, nslots);
+			if (!rings[i][n]) {
+				NL_SET_ERR_MSG(extack, "failed to allocate rings");
+				rc = -ENOMEM;
+				goto err_out;
+			}
+		}
+	}
+
+	return 0;
+
+err_out:
+	pval_abort_rings(pdev, rings);
+	return rc;
+}
+
+/* Producers move to the new rings by RCU, and the reader drains the
+ * old ring before reading the new one, so that no record is lost.
+ * All rings are published first, and one grace period covers them.
+ */
+static void pval_swap_rings(struct pval_dev *pdev,
+			    struct pval_ring *rings[][PVAL_MAX_CPUS])
+{
+	int i, n;
+	struct pval_mdev *pmdevs[] = { pdev->txmdevs, pdev->rxmdevs };
+	struct pval_mdev *pmdev;
+	struct pval_ring *old;
+
+	for (i = 0; i < ARRAY_SIZE(pmdevs); i++) {
+		for (n = 0; n < pdev->num_cpus; n++) {
+			if (!rings[i][n])
+				continue;
+
+			pmdev = &pmdevs[i][n];
+			mutex_lock(&pmdev->lock);
+			old = pmdev_ring(pmdev);
+			rings[i][n]->overwrite = old->overwrite;
+			rings[i][n]->frozen = old->frozen;
+			rings[i][n]->drops = old->drops;
+			rings[i][n]->drop_ts = old->drop_ts;
+			rcu_assign_pointer(pmdev->ring, rings[i][n]);
+
+			/* the reader keeps the old ring until swapping
+			 * ends, because producers may still be in it.
+			 */
+			if (pmdev->opened)
+				WRITE_ONCE(pmdev->old, old);
+			else
+				pval_put_ring(old);
+			rings[i][n] = old;
+			mutex_unlock(&pmdev->lock);
+		}
+	}
+
+	/* wait for producers to leave the old rings */
+	synchronize_net();
+	WRITE_ONCE(pdev->swapping, false);
+
+	for (i = 0; i < ARRAY_SIZE(pmdevs); i++) {
+		for (n = 0; n < pdev->num_cpus; n++) {
+			pmdev = &pmdevs[i][n];
+			old = rings[i][n];
+			mutex_lock(&pmdev->lock);
+			if (old && pmdev->old == old && ring_emtpy(old) &&
+			    !atomic_read(&old->overrun)) {
+				WRITE_ONCE(pmdev->old, NULL);
+				pval_put_ring(old);
+			}
+			mutex_unlock(&pmdev->lock);
+		}
+	}
+}
+
 static int pval_changelink(struct net_device *dev, struct nlattr *tb[],
 			   struct nlattr *data[],
 			   struct netlink_ext_ack *extack)
 {
+	int rc;
 	struct pval_dev *pdev = netdev_priv(dev);
+	struct pval_ring *rings[2][PVAL_MAX_CPUS] = { };
+	u8 layout = pdev->layout;
+	bool hugepage = pdev->hugepage;
+	u32 ringsize = pdev->ringsize;
+	bool promisc = pdev->promisc;
+	bool swap = false;
 	
-	if (data && data[IFLA_PVAL_LINK]) {
+	if (data && (data[IFLA_PVAL_LINK] || data[IFLA_PVAL_LINKS])) {
 		NL_SET_ERR_MSG(extack, "changing link is not supported\n");
 		return -ENOTSUPP;
 	}
 
-	pval_nl_config(pdev, tb, data, extack);;
+	/* every check is done before the change, and rings are swapped
+	 * after the rest is applied.
+	 */
+	rc = pval_nl_validate(pdev, data, extack);
+	if (rc < 0)
+		return rc;
+
+	if (data && data[IFLA_PVAL_LAYOUT])
+		layout = nla_get_u8(data[IFLA_PVAL_LAYOUT]);
+
+	if (data && data[IFLA_PVAL_HUGEPAGE])
+		hugepage = !!nla_get_u8(data[IFLA_PVAL_HUGEPAGE]);
+
+	if (data && data[IFLA_PVAL_RINGSIZE])
+		ringsize = nla_get_u32(data[IFLA_PVAL_RINGSIZE]);
+
+	if (data && (data[IFLA_PVAL_LAYOUT] || data[IFLA_PVAL_HUGEPAGE] ||
+		     data[IFLA_PVAL_RINGSIZE])) {
+		rc = pval_prepare_rings(pdev, layout, hugepage, ringsize,
+					rings, extack);
+		if (rc < 0)
+			return rc;
+		swap = true;
+	}
+
+	rc = pval_nl_config(pdev, tb, data, extack);
+	if (rc < 0)
+		goto err_out;
+
+	if (netif_running(dev) && data && data[IFLA_PVAL_CLKCORR]) {
+		pval_clk_stop(pdev);
+		pval_clk_start(pdev);
+	}
+
+	if (netif_running(dev))
+		pdev->pace_mode = pval_pace_mode(pdev);
+
+	if (netif_running(dev) && !pdev->passive &&
+	    promisc != pdev->promisc) {
+		/* add the new filters first, then delete the old ones */
+		rc = pval_filters_add(pdev);
+		if (rc < 0) {
+			pdev->promisc = promisc;
+			goto err_out;
+		}
+		pdev->promisc = promisc;
+		pval_filters_del(pdev);
+		pdev->promisc = !promisc;
+	}
 
 	/* XXX: update tstamp config 
 	 * should handle pval_*_tstamp_config errors here.
 	 */
 	pval_set_tstamp_config(pdev);
 
+	if (swap)
+		pval_swap_rings(pdev, rings);
+
 	return 0;
+
+err_out:
+	if (swap)
+		pval_abort_rings(pdev, rings);
+	return rc;
 }
 
 static void pval_dellink(struct net_device *dev, struct list_head *head)
 {
-	int n;
 	struct pval_dev *pdev = netdev_priv(dev);
+	struct pval_link *pl;
 
 	pval_restore_tstamp_config(pdev);
-	dev_put(pdev->link);
+	pval_xdp_attach(pdev, -1, NULL);
+	pval_for_each_link(pdev, pl)
+		dev_put(pl->dev);
 	list_del_rcu(&pdev->list);
 
 	unregister_netdevice_queue(dev, head);
-	netdev_upper_dev_unlink(pdev->link, dev);
+	pval_for_each_link(pdev, pl)
+		netdev_upper_dev_unlink(pl->dev, dev);
 
-	for (n = 0; n < pdev->num_cpus; n++) {
-		pval_destroy_miscdevice(&pdev->txmdevs[n]);
-		pval_destroy_miscdevice(&pdev->rxmdevs[n]);
-	}
+	/* rings are freed in pval_uninit() after the device is closed */
 }
 
 
 static size_t pval_get_size(const struct net_device *dev)
 {
-	return nla_total_size(sizeof(u32));	/* IFLA_PVAL_LINK */
-
-	return 0;
+	return nla_total_size(sizeof(u32)) +	/* IFLA_PVAL_LINK */
+		nla_total_size(sizeof(u8)) * 6 + /* IFLA_PVAL_{IPOPT..TXBUSYDROP} */
+		nla_total_size(sizeof(u32)) +	/* IFLA_PVAL_WAKEUP */
+		nla_total_size(sizeof(u32)) +	/* IFLA_PVAL_BUSYPOLL */
+		nla_total_size(sizeof(u8)) +	/* IFLA_PVAL_LAYOUT */
+		nla_total_size(sizeof(u8)) +	/* IFLA_PVAL_GRO */
+		nla_total_size(sizeof(u8)) +	/* IFLA_PVAL_TSSRC */
+		nla_total_size(sizeof(u32)) +	/* IFLA_PVAL_CLKCORR */
+		nla_total_size(sizeof(u8)) +	/* IFLA_PVAL_FLOWSEQ */
+		nla_total_size(sizeof(u8)) +	/* IFLA_PVAL_IPOPTTS */
+		nla_total_size(sizeof(u8)) +	/* IFLA_PVAL_CARRIER */
+		nla_total_size(sizeof(u16)) +	/* IFLA_PVAL_UDPPORT */
+		nla_total_size(sizeof(u8)) +	/* IFLA_PVAL_HUGEPAGE */
+		nla_total_size(sizeof(u8)) +	/* IFLA_PVAL_XDP */
+		nla_total_size(sizeof(u32)) +	/* IFLA_PVAL_PACEGAP */
+		nla_total_size_64bit(sizeof(u64)) + /* IFLA_PVAL_PACERATE */
+		nla_total_size(sizeof(u32)) +	/* IFLA_PVAL_PACEMARK */
+		nla_total_size(sizeof(u8)) +	/* IFLA_PVAL_PROMISC */
+		nla_total_size(sizeof(u8)) +	/* IFLA_PVAL_PASSIVE */
+		nla_total_size(sizeof(u32) * PVAL_MAX_LINKS) + /* LINKS */
+		nla_total_size(sizeof(u8)) +	/* IFLA_PVAL_TXQSTATE */
+		nla_total_size(sizeof(u32)) +	/* IFLA_PVAL_BURSTWIN */
+		nla_total_size(sizeof(u32)) +	/* IFLA_PVAL_BURSTBYTES */
+		nla_total_size(sizeof(u32)) +	/* IFLA_PVAL_RINGSIZE */
+		nla_total_size(sizeof(u16));	/* IFLA_PVAL_SNAPLEN */
 }
 
 static int pval_fill_info(struct sk_buff *skb, const struct net_device *dev)
 {
 	struct pval_dev *pdev = netdev_priv(dev);
+	u32 ifindexes[PVAL_MAX_LINKS];
+	int n;
 
 	if (nla_put_u32(skb, IFLA_PVAL_LINK, pdev->link->ifindex))
 		return -EMSGSIZE;
@@ -1046,6 +4690,78 @@ static int pval_fill_info(struct sk_buff *skb, const struct net_device *dev)
 	if (nla_put_u8(skb, IFLA_PVAL_TXBUSYDROP, pdev->txbusydrop ? 1 : 0))
 		return -EMSGSIZE;
 
+	if (nla_put_u32(skb, IFLA_PVAL_WAKEUP, pdev->wakeup))
+		return -EMSGSIZE;
+
+	if (nla_put_u32(skb, IFLA_PVAL_BUSYPOLL, pdev->busypoll))
+		return -EMSGSIZE;
+
+	if (nla_put_u8(skb, IFLA_PVAL_LAYOUT, pdev->layout))
+		return -EMSGSIZE;
+
+	if (nla_put_u8(skb, IFLA_PVAL_GRO, pdev->gro))
+		return -EMSGSIZE;
+
+	if (nla_put_u8(skb, IFLA_PVAL_TSSRC, pdev->tssrc))
+		return -EMSGSIZE;
+
+	if (nla_put_u32(skb, IFLA_PVAL_CLKCORR, pdev->clkcorr))
+		return -EMSGSIZE;
+
+	if (nla_put_u8(skb, IFLA_PVAL_FLOWSEQ, pdev->flowseq ? 1 : 0))
+		return -EMSGSIZE;
+
+	if (nla_put_u8(skb, IFLA_PVAL_IPOPTTS, pdev->ipoptts))
+		return -EMSGSIZE;
+
+	if (nla_put_u8(skb, IFLA_PVAL_CARRIER, pdev->carrier))
+		return -EMSGSIZE;
+
+	if (nla_put_u16(skb, IFLA_PVAL_UDPPORT, pdev->udpport))
+		return -EMSGSIZE;
+
+	if (nla_put_u8(skb, IFLA_PVAL_HUGEPAGE, pdev->hugepage ? 1 : 0))
+		return -EMSGSIZE;
+
+	if (nla_put_u8(skb, IFLA_PVAL_XDP, pdev->xdp ? 1 : 0))
+		return -EMSGSIZE;
+
+	if (nla_put_u32(skb, IFLA_PVAL_PACEGAP, pdev->pacegap))
+		return -EMSGSIZE;
+
+	if (nla_put_u64_64bit(skb, IFLA_PVAL_PACERATE, pdev->pacerate,
+			      IFLA_PVAL_PAD))
+		return -EMSGSIZE;
+
+	if (nla_put_u32(skb, IFLA_PVAL_PACEMARK, pdev->pacemark))
+		return -EMSGSIZE;
+
+	if (nla_put_u8(skb, IFLA_PVAL_PROMISC, pdev->promisc ? 1 : 0))
+		return -EMSGSIZE;
+
+	if (nla_put_u8(skb, IFLA_PVAL_PASSIVE, pdev->passive ? 1 : 0))
+		return -EMSGSIZE;
+
+	for (n = 0; n < pdev->num_links; n++)
+		ifindexes[n] = pdev->links[n].dev->ifindex;
+	if (nla_put(skb, IFLA_PVAL_LINKS, n * sizeof(u32), ifindexes))
+		return -EMSGSIZE;
+
+	if (nla_put_u8(skb, IFLA_PVAL_TXQSTATE, pdev->txqstate ? 1 : 0))
+		return -EMSGSIZE;
+
+	if (nla_put_u32(skb, IFLA_PVAL_BURSTWIN, pdev->burstwin))
+		return -EMSGSIZE;
+
+	if (nla_put_u32(skb, IFLA_PVAL_BURSTBYTES, pdev->burstbytes))
+		return -EMSGSIZE;
+
+	if (nla_put_u32(skb, IFLA_PVAL_RINGSIZE, pdev->ringsize))
+		return -EMSGSIZE;
+
+	if (nla_put_u16(skb, IFLA_PVAL_SNAPLEN, pdev->snaplen))
+		return -EMSGSIZE;
+
 	return 0;
 }
 
@@ -1123,6 +4839,8 @@ static int __init pval_init_module(void)
 	if (rc)
 		goto out2;
 
+	pval_txq_register();
+
 	pr_info("Load Pval Moudle (v%s)\n", PVAL_VERSION);
 
 	return 0;
@@ -1138,6 +4856,8 @@ static void __exit pval_exit_module(void)
 {
 	rtnl_link_unregister(&pval_link_ops);
 	unregister_pernet_subsys(&pval_net_ops);
+	pval_txq_unregister();
+	rcu_barrier();	/* rings freed by pval_put_ring() */
 
 	pr_info("Unload Pval Module (v%s)\n", PVAL_VERSION);
 }
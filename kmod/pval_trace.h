@@ -0,0 +1,222 @@
+/*
+ * pval_trace.h: tracepoints on pval datapath events
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM pval
+
+#if !defined(_PVAL_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _PVAL_TRACE_H_
+
+#include <linux/netdevice.h>
+#include <linux/tracepoint.h>
+#include <pval.h>
+
+TRACE_EVENT(xmit,
+
+	TP_PROTO(const struct net_device *dev, int cpu, unsigned int len,
+		 int rc, u64 seq, u32 occupancy),
+
+	TP_ARGS(dev, cpu, len, rc, seq, occupancy),
+
+	TP_STRUCT__entry(
+		__string(	name,		dev->name	)
+		__field(	int,		cpu		)
+		__field(	unsigned int,	len		)
+		__field(	int,		rc		)
+		__field(	u64,		seq		)
+		__field(	u32,		occupancy	)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, dev->name);
+		__entry->cpu		= cpu;
+		__entry->len		= len;
+		__entry->rc		= rc;
+		__entry->seq		= seq;
+		__entry->occupancy	= occupancy;
+	),
+
+	TP_printk("dev=%s cpu=%d len=%u rc=%d seq=%llu occupancy=%u",
+		  __get_str(name), __entry->cpu, __entry->len, __entry->rc,
+		  __entry->seq, __entry->occupancy)
+);
+
+TRACE_EVENT(rx,
+
+	TP_PROTO(const struct net_device *dev, int cpu, unsigned int len,
+		 u32 occupancy),
+
+	TP_ARGS(dev, cpu, len, occupancy),
+
+	TP_STRUCT__entry(
+		__string(	name,		dev->name	)
+		__field(	int,		cpu		)
+		__field(	unsigned int,	len		)
+		__field(	u32,		occupancy	)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, dev->name);
+		__entry->cpu		= cpu;
+		__entry->len		= len;
+		__entry->occupancy	= occupancy;
+	),
+
+	TP_printk("dev=%s cpu=%d len=%u occupancy=%u",
+		  __get_str(name), __entry->cpu, __entry->len,
+		  __entry->occupancy)
+);
+
+/* a record is dropped because the ring is full or frozen */
+TRACE_EVENT(ring_full,
+
+	TP_PROTO(const struct net_device *dev, int cpu, u8 dir,
+		 u32 occupancy, bool frozen),
+
+	TP_ARGS(dev, cpu, dir, occupancy, frozen),
+
+	TP_STRUCT__entry(
+		__string(	name,		dev->name	)
+		__field(	int,		cpu		)
+		__field(	u8,		dir		)
+		__field(	u32,		occupancy	)
+		__field(	bool,		frozen		)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, dev->name);
+		__entry->cpu		= cpu;
+		__entry->dir		= dir;
+		__entry->occupancy	= occupancy;
+		__entry->frozen		= frozen;
+	),
+
+	TP_printk("dev=%s cpu=%d dir=%s occupancy=%u frozen=%d",
+		  __get_str(name), __entry->cpu,
+		  __entry->dir ? "rx" : "tx", __entry->occupancy,
+		  __entry->frozen)
+);
+
+DECLARE_EVENT_CLASS(txtstamp,
+
+	TP_PROTO(const struct net_device *dev, int cpu, u64 seq,
+		 u64 latency, u32 occupancy),
+
+	TP_ARGS(dev, cpu, seq, latency, occupancy),
+
+	TP_STRUCT__entry(
+		__string(	name,		dev->name	)
+		__field(	int,		cpu		)
+		__field(	u64,		seq		)
+		__field(	u64,		latency		)
+		__field(	u32,		occupancy	)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, dev->name);
+		__entry->cpu		= cpu;
+		__entry->seq		= seq;
+		__entry->latency	= latency;
+		__entry->occupancy	= occupancy;
+	),
+
+	TP_printk("dev=%s cpu=%d seq=%llu latency=%lluns occupancy=%u",
+		  __get_str(name), __entry->cpu, __entry->seq,
+		  __entry->latency, __entry->occupancy)
+);
+
+/* latency is from xmit to the hw tstamp found (or given up) */
+DEFINE_EVENT(txtstamp, txtstamp_done,
+
+	TP_PROTO(const struct net_device *dev, int cpu, u64 seq,
+		 u64 latency, u32 occupancy),
+
+	TP_ARGS(dev, cpu, seq, latency, occupancy)
+);
+
+DEFINE_EVENT(txtstamp, txtstamp_timeout,
+
+	TP_PROTO(const struct net_device *dev, int cpu, u64 seq,
+		 u64 latency, u32 occupancy),
+
+	TP_ARGS(dev, cpu, seq, latency, occupancy)
+);
+
+TRACE_EVENT(ipopt_insert,
+
+	TP_PROTO(const struct net_device *dev, int cpu, u8 carrier,
+		 u8 length, u64 seq),
+
+	TP_ARGS(dev, cpu, carrier, length, seq),
+
+	TP_STRUCT__entry(
+		__string(	name,		dev->name	)
+		__field(	int,		cpu		)
+		__field(	u8,		carrier		)
+		__field(	u8,		length		)
+		__field(	u64,		seq		)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, dev->name);
+		__entry->cpu		= cpu;
+		__entry->carrier	= carrier;
+		__entry->length		= length;
+		__entry->seq		= seq;
+	),
+
+	TP_printk("dev=%s cpu=%d carrier=%u length=%u seq=%llu",
+		  __get_str(name), __entry->cpu, __entry->carrier,
+		  __entry->length, __entry->seq)
+);
+
+/* a record is built for a ring. It carries meta and the copied bytes
+ * of pkt, and bpf/pval_perfbuf.c reads them from this entry. Keep the
+ * order of the fields in sync with struct pval_record_args there.
+ */
+TRACE_EVENT(pval_record,
+
+	TP_PROTO(const struct net_device *dev, u8 cpu, u8 dir, u64 tstamp,
+		 u32 pktlen, const struct pval_meta *meta, const void *pkt,
+		 u32 caplen),
+
+	TP_ARGS(dev, cpu, dir, tstamp, pktlen, meta, pkt, caplen),
+
+	TP_STRUCT__entry(
+		__string(	name,		dev->name	)
+		__field(	u8,		cpu		)
+		__field(	u8,		dir		)
+		__field(	u32,		pktlen		)
+		__field(	u32,		caplen		)
+		__field(	u64,		tstamp		)
+		__field_struct(	struct pval_meta, meta		)
+		__dynamic_array(u8,		pkt,	caplen	)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, dev->name);
+		__entry->cpu		= cpu;
+		__entry->dir		= dir;
+		__entry->pktlen		= pktlen;
+		__entry->caplen		= caplen;
+		__entry->tstamp		= tstamp;
+		__entry->meta		= *meta;
+		memcpy(__get_dynamic_array(pkt), pkt, caplen);
+	),
+
+	TP_printk("dev=%s cpu=%u dir=%s type=%u tstamp=%llu pktlen=%u "
+		  "caplen=%u hash=0x%08x seq=%llu",
+		  __get_str(name), __entry->cpu,
+		  __entry->dir ? "rx" : "tx", __entry->meta.type,
+		  __entry->tstamp, __entry->pktlen, __entry->caplen,
+		  __entry->meta.hash, __entry->meta.seq)
+);
+
+#endif /* _PVAL_TRACE_H_ */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE pval_trace
+#include <trace/define_trace.h>
@@ -248,6 +248,7 @@ struct netdissect_options {
 #define PT_PGM_ZMTP1	15	/* ZMTP/1.0 inside PGM (native or UDP-encapsulated) */
 #define PT_LMP		16	/* Link Management Protocol */
 #define PT_RESP		17	/* RESP */
+#define PT_PVAL		18	/* Pval IP Option in a UDP shim */
 
 #ifndef min
 #define min(a,b) ((a)>(b)?(b):(a))
@@ -544,6 +545,8 @@ extern void igrp_print(netdissect_options *, const u_char *, u_int);
 extern void ip6_print(netdissect_options *, const u_char *, u_int);
 extern void ipN_print(netdissect_options *, const u_char *, u_int);
 extern void ip_print(netdissect_options *, const u_char *, u_int);
+extern void pval_print(netdissect_options *, const u_char *, u_int);
+extern void pval_trailer_print(netdissect_options *, const u_char *, u_int);
 extern void ip_inner_print(netdissect_options *, const u_char *, u_int, u_int nh, const u_char *);
 extern void ipcomp_print(netdissect_options *, const u_char *);
 extern void ipx_netbios_print(netdissect_options *, const u_char *, u_int);
@@ -151,7 +151,7 @@ ether_print(netdissect_options *ndo,
             void (*print_encap_header)(netdissect_options *ndo, const u_char *), const u_char *encap_header_arg)
 {
 	const struct ether_header *ehp;
-	u_int orig_length;
+	u_int orig_length, orig_caplen;
 	u_short length_type;
 	u_int hdrlen;
 	int llc_hdrlen;
@@ -173,6 +173,7 @@ ether_print(netdissect_options *ndo,
 		ether_hdr_print(ndo, p, length);
 	}
 	orig_length = length;
+	orig_caplen = caplen;
 
 	length -= ETHER_HDRLEN;
 	caplen -= ETHER_HDRLEN;
@@ -262,6 +263,8 @@ recurse:
 				ND_DEFAULTPRINT(p, caplen);
 		}
 	}
+	if (orig_caplen >= orig_length)
+		pval_trailer_print(ndo, (const u_char *)ehp, orig_length);
 	return (hdrlen);
 }
 
@@ -254,7 +254,19 @@ ip_printpval(netdissect_options *ndo,
 	}
 
 	ipp = (const struct ipopt_pval *)cp;
-	ND_PRINT(" cpu %u, seq %llu", ipp->cpu, ipp->seq);
+	ND_PRINT(" v%u cpu %u, %s %llu", IPOPT_PVAL_VER(ipp->ver), ipp->cpu,
+		 ipp->ver & IPOPT_PVAL_F_FLOWSEQ ? "flowseq" : "seq",
+		 ipp->seq);
+
+	if (IPOPT_PVAL_VER(ipp->ver) >= IPOPT_PVAL_V1) {
+		const struct ipopt_pval_v1 *ipp1;
+
+		ipp1 = (const struct ipopt_pval_v1 *)cp;
+		if (length >= IPOPT_PVAL_LEN_TS64)
+			ND_PRINT(", txts %llu", ipp1->ts.ts64);
+		else if (length >= IPOPT_PVAL_LEN_TS32)
+			ND_PRINT(", txts32 %u", ipp1->ts.ts32);
+	}
 
 	return (0);
 
@@ -262,6 +274,53 @@ trunc:
 	return (-1);
 }
 
+/*
+ * print Pval IP Option carried in a UDP shim.
+ */
+void
+pval_print(netdissect_options *ndo, const u_char *cp, u_int length)
+{
+	if (length < sizeof(struct ipopt_pval) ||
+	    !ND_TTEST_LEN(cp, sizeof(struct ipopt_pval)) ||
+	    EXTRACT_U_1(cp) != IPOPT_PVAL)
+		return;
+
+	ND_PRINT(" pval");
+	if (!ND_TTEST_LEN(cp, EXTRACT_U_1(cp + 1)) ||
+	    EXTRACT_U_1(cp + 1) > length) {
+		ND_PRINT("[|pval]");
+		return;
+	}
+	ip_printpval(ndo, cp, EXTRACT_U_1(cp + 1));
+}
+
+/*
+ * print Pval IP Option carried in an Ethernet trailer. p points the
+ * Ethernet header of a frame of length bytes.
+ */
+void
+pval_trailer_print(netdissect_options *ndo, const u_char *p, u_int length)
+{
+	const struct pval_trailer *t;
+	u_int optlen;
+
+	if (length < sizeof(*t))
+		return;
+
+	t = (const struct pval_trailer *)(p + length - sizeof(*t));
+	if (!ND_TTEST_LEN(t, sizeof(*t)) ||
+	    EXTRACT_BE_U_4(&t->magic) != PVAL_TRAILER_MAGIC)
+		return;
+
+	optlen = EXTRACT_U_1(&t->length);
+	if (optlen < sizeof(struct ipopt_pval) ||
+	    optlen + sizeof(*t) > length)
+		return;
+
+	ND_PRINT(", pval trailer");
+	ip_printpval(ndo, (const u_char *)t - optlen, optlen);
+}
+
 /*
  * print IP options.
    If truncated return -1, else 0.
@@ -42,6 +42,8 @@
 
 #include "nfs.h"
 
+#include "../include/pval.h"
+
 
 struct rtcphdr {
 	nd_uint16_t rh_flags;	/* T:2 P:1 CNT:5 PT:8 */
@@ -512,6 +514,11 @@ udp_print(netdissect_options *ndo, const u_char *bp, u_int length,
 			udpipaddr_print(ndo, ip, sport, dport);
 			lmp_print(ndo, cp, length);
 			break;
+
+		case PT_PVAL:
+			udpipaddr_print(ndo, ip, sport, dport);
+			pval_print(ndo, (const u_char *)(up + 1), length);
+			break;
 		}
 		return;
 	}
@@ -700,6 +707,8 @@ udp_print(netdissect_options *ndo, const u_char *bp, u_int length,
 			lisp_print(ndo, (const u_char *)(up + 1), length);
 		else if (IS_SRC_OR_DST_PORT(VXLAN_GPE_PORT))
 			vxlan_gpe_print(ndo, (const u_char *)(up + 1), length);
+		else if (dport == PVAL_UDP_PORT_DEFAULT)
+			pval_print(ndo, (const u_char *)(up + 1), length);
 		else if (ND_TTEST_1(((const struct LAP *)cp)->type) &&
 			 EXTRACT_U_1(((const struct LAP *)cp)->type) == lapDDP &&
 			 (atalk_port(sport) || atalk_port(dport))) {
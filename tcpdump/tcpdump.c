@@ -1755,6 +1755,8 @@ main(int argc, char **argv)
 				ndo->ndo_packettype = PT_LMP;
 			else if (ascii_strcasecmp(optarg, "resp") == 0)
 				ndo->ndo_packettype = PT_RESP;
+			else if (ascii_strcasecmp(optarg, "pval") == 0)
+				ndo->ndo_packettype = PT_PVAL;
 			else
 				error("unknown packet type `%s'", optarg);
 			break;
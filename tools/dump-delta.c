@@ -0,0 +1,183 @@
+/*
+ * read the delta stream (PVAL_IOC_DELTA) from a pval chardev
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <endian.h>
+
+#include <pval.h>
+
+#define BUFSIZE	(64 * 1024)
+
+static const uint8_t *get_varint(const uint8_t *p, const uint8_t *end,
+				 uint64_t *v)
+{
+	int shift = 0;
+
+	*v = 0;
+	while (p < end && shift < 64) {
+		*v |= (uint64_t)(*p & 0x7f) << shift;
+		if (!(*p++ & 0x80))
+			return p;
+		shift += 7;
+	}
+	return NULL;
+}
+
+static uint64_t get_le64(const uint8_t *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return le64toh(v);
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return le32toh(v);
+}
+
+void parse_and_print(const uint8_t *p, const uint8_t *end)
+{
+	uint32_t flows[PVAL_DELTA_FLOWS];
+	uint64_t tag, delta, pktlen, base = 0;
+	struct pval_clock clk;
+	struct pval_burst b;
+	int64_t sdelta;
+	uint8_t type, id, len;
+
+	memset(flows, 0, sizeof(flows));
+
+	while (p < end) {
+		p = get_varint(p, end, &tag);
+		if (!p)
+			goto trunc;
+
+		switch (tag & PVAL_DELTA_T_MASK) {
+		case PVAL_DELTA_T_SYNC:
+			if (end - p < 8)
+				goto trunc;
+			base = get_le64(p);
+			p += 8;
+			memset(flows, 0, sizeof(flows));
+			printf("SYNC %lu\n", base);
+			break;
+
+		case PVAL_DELTA_T_PKT:
+		case PVAL_DELTA_T_FLOW:
+			delta = tag >> PVAL_DELTA_T_SHIFT;
+			sdelta = (int64_t)(delta >> 1) ^ -(int64_t)(delta & 1);
+			base += sdelta;
+			p = get_varint(p, end, &pktlen);
+			if (!p || p >= end)
+				goto trunc;
+			id = *p++ % PVAL_DELTA_FLOWS;
+			if ((tag & PVAL_DELTA_T_MASK) == PVAL_DELTA_T_FLOW) {
+				if (end - p < 4)
+					goto trunc;
+				flows[id] = get_le32(p);
+				p += 4;
+			}
+			printf("%lu %+ld len %lu flow %u hash 0x%08x\n",
+			       base, sdelta, pktlen, id, flows[id]);
+			break;
+
+		case PVAL_DELTA_T_REC:
+			type = tag >> PVAL_DELTA_T_SHIFT;
+			if (end - p < 9)
+				goto trunc;
+			len = p[8];
+			if (end - p < 9 + len)
+				goto trunc;
+			if (type == PVAL_REC_CLOCK && len == sizeof(clk)) {
+				memcpy(&clk, p + 9, sizeof(clk));
+				printf("CLOCK phc=%llu realtime=%llu "
+				       "monoraw=%llu err=%u\n", clk.phc,
+				       clk.realtime, clk.monoraw, clk.error);
+			} else if (type == PVAL_REC_BURST && len == sizeof(b)) {
+				memcpy(&b, p + 9, sizeof(b));
+				printf("BURST start=%llu end=%llu bytes=%llu "
+				       "pkts=%u hash=0x%08x\n", b.start, b.end,
+				       b.bytes, b.pkts, b.hash);
+			} else if (type == PVAL_REC_OVERRUN && len == 8)
+				printf("OVERRUN %lu records overwritten\n",
+				       get_le64(p + 9));
+			else if (type == PVAL_REC_GAP && len == 8)
+				printf("GAP %lu %lu records dropped\n",
+				       get_le64(p), get_le64(p + 9));
+			else
+				printf("REC type %u len %u\n", type, len);
+			p += 9 + len;
+			break;
+		}
+	}
+	return;
+
+trunc:
+	printf("truncated record\n");
+}
+
+int main(int argc, char **argv)
+{
+	int fd, ret;
+	uint8_t *buf;
+	struct pollfd x;
+
+	if (argc < 2) {
+		printf("%s [Pval chardev]\n", argv[0]);
+		return -1;
+	}
+
+	fd = open(argv[1], O_RDONLY);
+	if (fd < 0) {
+		printf("%s\n", argv[1]);
+		perror("open");
+		return -1;
+	}
+
+	if (ioctl(fd, PVAL_IOC_DELTA, 1) < 0) {
+		perror("ioctl");
+		return -1;
+	}
+
+	buf = malloc(BUFSIZE);
+	if (!buf) {
+		perror("malloc");
+		return -1;
+	}
+
+	x.fd = fd;
+	x.events = POLLIN;
+
+	while (1) {
+		if (poll(&x, 1, 1000) < 0) {
+			perror("poll");
+			return -1;
+		}
+
+		if (!(x.revents & POLLIN))
+			continue;
+
+		ret = read(fd, buf, BUFSIZE);
+		if (ret < 0) {
+			perror("read");
+			continue;
+		}
+
+		parse_and_print(buf, buf + ret);
+	}
+
+	return 0;
+}
@@ -34,6 +34,37 @@ void parse_and_print(struct pval_slot *slot, char *prefix)
 	struct ethhdr *eth;
 	struct iphdr *iph;
 	char abuf1[16], abuf2[16];
+	struct pval_clock *clk;
+	struct pval_burst *b;
+
+	if (slot->meta.type == PVAL_REC_CLOCK) {
+		clk = (struct pval_clock *)slot->pkt;
+		printf("%s: CLOCK ifindex=%u phc=%llu realtime=%llu "
+		       "monoraw=%llu err=%u\n", prefix, slot->meta.ifindex,
+		       clk->phc, clk->realtime, clk->monoraw, clk->error);
+		return;
+	}
+
+	if (slot->meta.type == PVAL_REC_OVERRUN) {
+		printf("%s: OVERRUN %llu records overwritten\n",
+		       prefix, slot->meta.seq);
+		return;
+	}
+
+	if (slot->meta.type == PVAL_REC_GAP) {
+		printf("%s: TS=%llu GAP %llu records dropped\n",
+		       prefix, slot->tstamp, slot->meta.seq);
+		return;
+	}
+
+	if (slot->meta.type == PVAL_REC_BURST) {
+		b = (struct pval_burst *)slot->pkt;
+		printf("%s: BURST start=%llu end=%llu bytes=%llu pkts=%u "
+		       "hash=0x%08x window=%u windows=%u\n",
+		       prefix, b->start, b->end, b->bytes, b->pkts, b->hash,
+		       b->window, b->windows);
+		return;
+	}
 
 	printf("%s: TS=%llu ", prefix, slot->tstamp);
 	
@@ -46,11 +77,12 @@ void parse_and_print(struct pval_slot *slot, char *prefix)
 	       eth->h_dest[3], eth->h_dest[4], eth->h_dest[5],
 	       ntohs(eth->h_proto));
 
-	if (ntohs(eth->h_proto) != ETH_P_IP)
+	if (ntohs(slot->meta.proto) != ETH_P_IP ||
+	    !(slot->meta.flags & PVAL_META_F_L3))
 		goto out;
 
 
-	iph = (struct iphdr *)(eth + 1);
+	iph = (struct iphdr *)(slot->pkt + slot->meta.l3off);
 	inet_ntop(AF_INET, &iph->saddr, abuf1, sizeof(abuf1));
 	inet_ntop(AF_INET, &iph->daddr, abuf2, sizeof(abuf2));
 	printf("%s -> %s", abuf1, abuf2);
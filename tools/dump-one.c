@@ -24,6 +24,36 @@ void parse_and_print(struct pval_slot *slot)
 	struct ethhdr *eth;
 	struct iphdr *iph;
 	char abuf1[16], abuf2[16];
+	struct pval_clock *clk;
+	struct pval_burst *b;
+
+	if (slot->meta.type == PVAL_REC_CLOCK) {
+		clk = (struct pval_clock *)slot->pkt;
+		printf("CLOCK ifindex=%u phc=%llu realtime=%llu monoraw=%llu "
+		       "err=%u\n", slot->meta.ifindex, clk->phc,
+		       clk->realtime, clk->monoraw, clk->error);
+		return;
+	}
+
+	if (slot->meta.type == PVAL_REC_OVERRUN) {
+		printf("OVERRUN %llu records overwritten\n", slot->meta.seq);
+		return;
+	}
+
+	if (slot->meta.type == PVAL_REC_GAP) {
+		printf("%llu GAP %llu records dropped\n", slot->tstamp,
+		       slot->meta.seq);
+		return;
+	}
+
+	if (slot->meta.type == PVAL_REC_BURST) {
+		b = (struct pval_burst *)slot->pkt;
+		printf("BURST start=%llu end=%llu bytes=%llu pkts=%u "
+		       "hash=0x%08x window=%u windows=%u\n",
+		       b->start, b->end, b->bytes, b->pkts, b->hash,
+		       b->window, b->windows);
+		return;
+	}
 
 	printf("%llu ", slot->tstamp);
 	
@@ -36,15 +66,24 @@ void parse_and_print(struct pval_slot *slot)
 	       eth->h_dest[3], eth->h_dest[4], eth->h_dest[5],
 	       ntohs(eth->h_proto));
 
-	if (ntohs(eth->h_proto) != ETH_P_IP)
+	if (ntohs(slot->meta.proto) != ETH_P_IP ||
+	    !(slot->meta.flags & PVAL_META_F_L3))
 		goto out;
 
 
-	iph = (struct iphdr *)(eth + 1);
+	iph = (struct iphdr *)(slot->pkt + slot->meta.l3off);
 	inet_ntop(AF_INET, &iph->saddr, abuf1, sizeof(abuf1));
 	inet_ntop(AF_INET, &iph->daddr, abuf2, sizeof(abuf2));
 	printf("%s -> %s", abuf1, abuf2);
 
+	if (slot->meta.flags & PVAL_META_F_TXTS)
+		printf(" txts %llu", slot->meta.txts);
+	if (slot->meta.flags & PVAL_META_F_SCHED)
+		printf(" sched %llu", slot->meta.sched);
+	if (slot->meta.xflags & PVAL_META_X_TXQ)
+		printf(" txq %u inflight %u backlog %u", slot->meta.queue,
+		       slot->meta.inflight, slot->meta.backlog);
+
 out:
 	printf("\n");
 }
@@ -34,24 +34,23 @@ struct thread_body {
 void parse_and_print(struct pval_slot *slot, char *prefix)
 {
 	char out[256], buf[256];
-	struct ethhdr	*eth;
-	struct iphdr	*iph;
 	struct tcphdr	*tcp;
 
-	eth = (struct ethhdr *)slot->pkt;
+	if (slot->meta.type != PVAL_REC_PKT)
+		return;
+
 	snprintf(out, sizeof(out), "%s TS=%llu PKTLEN=%u ETHER_TYPE=0x%04x ",
-		 prefix, slot->tstamp, slot->pktlen, ntohs(eth->h_proto));
-	if (ntohs(eth->h_proto) != ETH_P_IP)
+		 prefix, slot->tstamp, slot->pktlen, ntohs(slot->meta.proto));
+	if (!(slot->meta.flags & PVAL_META_F_L4))
 		goto out;
 
-
-	iph = (struct iphdr *)(eth + 1);
-	snprintf(buf, sizeof(buf), "IP_PROTO=%u ", iph->protocol);
+	snprintf(buf, sizeof(buf), "IP_PROTO=%u ", slot->meta.ipproto);
 	strncat(out, buf, sizeof(out));
-	if (iph->protocol != IPPROTO_TCP)
+	if (slot->meta.ipproto != IPPROTO_TCP ||
+	    slot->meta.l4off + sizeof(*tcp) > slot->len)
 		goto out;
 
-	tcp = (struct tcphdr *)(((char*)iph) + (iph->ihl << 2));
+	tcp = (struct tcphdr *)(slot->pkt + slot->meta.l4off);
 	snprintf(buf, sizeof(buf), "SYN=%u ACK=%u PSH=%u RST=%u FIN=%u",
 		 tcp->syn, tcp->ack, tcp->psh, tcp->rst, tcp->fin);
 	strncat(out, buf, sizeof(out));
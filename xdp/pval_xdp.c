@@ -0,0 +1,41 @@
+/*
+ * pval_xdp.c: XDP program stamping RXed frames before skb allocation.
+ *
+ * Attach it to the lower link through pval:
+ *	ip link set dev pval0 type pval xdp obj pval_xdp.o tssrc xdp
+ */
+
+#include <linux/bpf.h>
+
+#include <pval.h>
+
+#define SEC(name) __attribute__((section(name), used))
+
+static unsigned long long (*bpf_ktime_get_ns)(void) =
+	(void *) BPF_FUNC_ktime_get_ns;
+static int (*bpf_xdp_adjust_meta)(void *ctx, int offset) =
+	(void *) BPF_FUNC_xdp_adjust_meta;
+
+SEC("prog")
+int pval_xdp(struct xdp_md *ctx)
+{
+	struct pval_xdp_meta *xm;
+	__u64 now = bpf_ktime_get_ns();
+	void *data;
+
+	if (bpf_xdp_adjust_meta(ctx, -(int)sizeof(*xm)) < 0)
+		return XDP_PASS;	/* no headroom for meta */
+
+	data = (void *)(long)ctx->data;
+	xm = (void *)(long)ctx->data_meta;
+	if ((void *)(xm + 1) > data)
+		return XDP_PASS;
+
+	xm->tstamp = now;
+	xm->reserved = 0;
+	xm->magic = PVAL_XDP_MAGIC;
+
+	return XDP_PASS;
+}
+
+char _license[] SEC("license") = "GPL";